@@ -31,7 +31,10 @@
 #include "ac_cfg.h"
 
 #include <sys/time.h> /* gettimeofday() */
+#include <time.h> /* clock_gettime() */
 
+#include <stdarg.h> /* va_list */
+#include <stdint.h> /* uint32_t */
 #include <stdio.h> /* sscanf() */
 #include <stdlib.h> /* malloc() */
 #include <string.h> /* memmove() etc. */
@@ -74,6 +77,37 @@
 #define XBEE_MAX_RETRIES 16
 #endif
 
+/*
+ * With the xbeenoack extended parameter, XBeeBoot packets are sent
+ * without ZigBee APS acknowledgements or retries, so the XBeeBoot
+ * ACKs are all that detect a lost packet.  Retransmit after this many
+ * milliseconds rather than the usual serial timeout, making
+ * proportionally more attempts to cover the same period.
+ */
+#ifndef XBEE_NOACK_TIMEOUT
+#define XBEE_NOACK_TIMEOUT 250
+#endif
+
+/*
+ * Received data not yet asked for by xbeedev_recv() is queued, up to
+ * this many bytes.  Beyond that, further replies are left unACKed for
+ * the bootloader to retransmit once the queue has been read.
+ */
+#ifndef XBEE_MAX_RECEIVE_QUEUE
+#define XBEE_MAX_RECEIVE_QUEUE 65536
+#endif
+
+/*
+ * Draining stops once no further frame has started for this many
+ * milliseconds.
+ */
+#ifndef XBEE_DRAIN_QUIET
+#define XBEE_DRAIN_QUIET 50
+#endif
+
+/* ZigBee Transmit Request option: Disable retries and route repair */
+#define XBEE_TX_DISABLE_ACK 0x01
+
 /*
  * Maximum chunk size, which is the maximum encapsulated payload to be
  * delivered to the remote CPU.
@@ -120,6 +154,120 @@
 /* Protocol */
 #define XBEEBOOT_PACKET_TYPE_ACK 0
 #define XBEEBOOT_PACKET_TYPE_REQUEST 1
+#define XBEEBOOT_PACKET_TYPE_BUSY 2
+
+/*
+ * A bootloader built with BUSY_REPLY answers a request it can't take
+ * yet with BUSY.  Retransmit after this many milliseconds, and give up
+ * after this many BUSY replies to one packet.
+ */
+#ifndef XBEE_BUSY_BACKOFF
+#define XBEE_BUSY_BACKOFF 20
+#endif
+#ifndef XBEE_MAX_BUSY
+#define XBEE_MAX_BUSY 100
+#endif
+
+/*
+ * XBeeBoot extension parameters, read with STK_GET_PARAMETER.  A
+ * bootloader without extensions answers these with the generic 0x03
+ * reply, which is distinguishable from a feature bitmap because the
+ * top bit of the feature bitmap is always set.
+ */
+#define XBEEBOOT_PARAM_FEATURES 0xe0
+#define XBEEBOOT_PARAM_JOURNAL_STATE 0xe1
+#define XBEEBOOT_PARAM_JOURNAL_LOW 0xe2
+#define XBEEBOOT_PARAM_JOURNAL_HIGH 0xe3
+#define XBEEBOOT_PARAM_PAGES 0xe4
+#define XBEEBOOT_PARAM_COUNTERS 0xe5 /* 0xe5-0xe8 */
+
+#define XBEEBOOT_FEATURE_BASE 0x80
+#define XBEEBOOT_FEATURE_JOURNAL 0x01
+#define XBEEBOOT_FEATURE_BUSY 0x02
+#define XBEEBOOT_FEATURE_RETRANSMIT 0x04
+#define XBEEBOOT_FEATURE_MULTI_PAGE 0x08
+#define XBEEBOOT_FEATURE_LINK_TEST 0x10
+#define XBEEBOOT_FEATURE_COUNTERS 0x20
+
+/*
+ * The bootloader's protocol counters, in parameter order.  Each wraps
+ * at 256.
+ */
+#define XBEEBOOT_COUNTER_CHECKSUM 0
+#define XBEEBOOT_COUNTER_SEQUENCE 1
+#define XBEEBOOT_COUNTER_BUSY 2
+#define XBEEBOOT_COUNTER_RETRANSMIT 3
+#define XBEEBOOT_COUNTERS 4
+
+#define XBEEBOOT_JOURNAL_INCOMPLETE 0xa5
+
+/*
+ * XBeeBoot's own commands.  LINK_TEST takes a count and that many
+ * bytes, which it throws away, and a reply count, which it answers
+ * with that many bytes counting down to 1 (modulo 256).
+ */
+#define XBEEBOOT_CMD_LINK_TEST 0xf0
+
+/*
+ * The xbeelinktest default: bytes sent each way, and the number of
+ * empty commands timed for the round trip.
+ */
+#ifndef XBEE_LINK_TEST_BYTES
+#define XBEE_LINK_TEST_BYTES 1024
+#endif
+#ifndef XBEE_LINK_TEST_ROUND_TRIPS
+#define XBEE_LINK_TEST_ROUND_TRIPS 10
+#endif
+
+/*
+ * When resuming an update the bootloader journaled as interrupted,
+ * this many bytes of each page recorded as written are read back to
+ * confirm the target still holds them, rather than the entire page.
+ */
+#ifndef XBEE_RESUME_SAMPLE
+#define XBEE_RESUME_SAMPLE 16
+#endif
+
+/*
+ * With a MULTI_PAGE bootloader, flash is read back this many pages at
+ * a time.  Pages avrdude doesn't go on to ask for are wasted, so this
+ * is kept small.
+ */
+#ifndef XBEE_READ_PAGES
+#define XBEE_READ_PAGES 4
+#endif
+
+/*
+ * Extended parameters other than the reset pin.  pgm->cookie belongs
+ * to the STK500 implementation and pgm->flag holds the reset pin, so
+ * these are kept here until xbee_open() creates the session.  avrdude
+ * only ever drives one programmer at a time.
+ */
+static struct {
+  int resume;
+  char *resumeFile;
+  int appEntry;
+  long noAckTimeout; /* milliseconds, zero unless xbeenoack */
+  long linkTest; /* bytes each way, zero unless xbeelinktest */
+  char *traceFile; /* NULL unless xbeetrace */
+  char *captureFile; /* NULL unless xbeecapture */
+  char *replayFile; /* NULL unless xbeereplay */
+  double replaySpeed; /* xbeereplayspeed, zero for as fast as possible */
+} xbeeExtParams = { .replaySpeed = 1 };
+
+/*
+ * The STK500 paged access implementations, which we wrap.
+ */
+static int (*xbee_stk500_paged_write)(PROGRAMMER *pgm, AVRPART *p,
+                                      AVRMEM *m, unsigned int page_size,
+                                      unsigned int addr,
+                                      unsigned int n_bytes);
+static int (*xbee_stk500_paged_load)(PROGRAMMER *pgm, AVRPART *p,
+                                     AVRMEM *m, unsigned int page_size,
+                                     unsigned int addr,
+                                     unsigned int n_bytes);
+static void (*xbee_stk500_disable)(PROGRAMMER *pgm);
+static int (*xbee_stk500_chip_erase)(PROGRAMMER *pgm, AVRPART *p);
 
 /*
  * Read signature bytes - Direct copy of the Arduino behaviour to
@@ -170,31 +318,112 @@ static int xbee_read_sig_bytes(PROGRAMMER *pgm, AVRPART *p, AVRMEM *m)
   return 3;
 }
 
+/*
+ * Read a single STK500 parameter from the bootloader.
+ *
+ * Return 0 on success, or a negative value on failure.
+ */
+static int xbee_getparm(PROGRAMMER *pgm, unsigned char parm,
+                        unsigned char *value)
+{
+  unsigned char buf[3];
+
+  buf[0] = Cmnd_STK_GET_PARAMETER;
+  buf[1] = parm;
+  buf[2] = Sync_CRC_EOP;
+
+  if (serial_send(&pgm->fd, buf, 3) < 0)
+    return -1;
+
+  if (serial_recv(&pgm->fd, buf, 3) < 0)
+    return -1;
+  if (buf[0] != Resp_STK_INSYNC || buf[2] != Resp_STK_OK) {
+    avrdude_message(MSG_INFO,
+                    "%s: xbee_getparm(): protocol error reading parameter "
+                    "0x%02x, resp=0x%02x 0x%02x\n",
+                    progname, (unsigned int)parm,
+                    (unsigned int)buf[0], (unsigned int)buf[2]);
+    return -2;
+  }
+
+  *value = buf[1];
+  return 0;
+}
+
+/*
+ * Times are in nanoseconds, from xbeeClock().
+ */
+#define XBEE_NS_FORMAT "%lu.%09lu"
+#define XBEE_NS_ARGS(ns) \
+  (unsigned long)((ns) / 1000000000), (unsigned long)((ns) % 1000000000)
+
 struct XBeeSequenceStatistics {
-  struct timeval sendTime;
+  uint64_t sendTime;
+  unsigned int retries; /* Resent this many times since sendTime */
 };
 
 struct XBeeStaticticsSummary {
-  struct timeval minimum;
-  struct timeval maximum;
-  struct timeval sum;
+  uint64_t minimum;
+  uint64_t maximum;
+  uint64_t sum;
   unsigned long samples;
 };
 
-#define XBEE_STATS_GROUPS 4
+#define XBEE_STATS_GROUPS 5
 #define XBEE_STATS_FRAME_LOCAL 0
 #define XBEE_STATS_FRAME_REMOTE 1
 #define XBEE_STATS_TRANSMIT 2
 #define XBEE_STATS_RECEIVE 3
+/* STK500 command to response, "sequence" is the command's opcode */
+#define XBEE_STATS_COMMAND 4
 
 static const char* groupNames[] =
   {
    "FRAME_LOCAL",
    "FRAME_REMOTE",
    "TRANSMIT",
-   "RECEIVE"
+   "RECEIVE",
+   "COMMAND"
   };
 
+/*
+ * The per-frame trace is kept in binary, in a ring of the last
+ * XBEE_LOG_ENTRIES events (a power of two), and only formatted as it
+ * happens at -vv, or all at once when the transport fails.  Build with
+ * XBEE_LOG_ENTRIES=0 to leave the ring out.
+ */
+#ifndef XBEE_LOG_ENTRIES
+#define XBEE_LOG_ENTRIES 64
+#endif
+
+#if XBEE_LOG_ENTRIES & (XBEE_LOG_ENTRIES - 1)
+#error XBEE_LOG_ENTRIES must be a power of two
+#endif
+
+enum xbee_log_event_enum {
+  XBEE_LOG_API_REQUEST,   /* packetType, sequence, appType, data[0] */
+  XBEE_LOG_STATS_SEND,    /* sequence, detailSequence or -1 */
+  XBEE_LOG_STATS_RECEIVE, /* sequence, delay seconds, delay nanoseconds */
+  XBEE_LOG_FRAME,         /* frameType */
+  XBEE_LOG_BAD_CHECKSUM,  /* checksum */
+  XBEE_LOG_TRANSMIT_STATUS, /* frame sequence, result code */
+  XBEE_LOG_PACKET         /* protocolType, sequence */
+};
+
+struct XBeeLogEntry {
+  uint64_t time;
+  char const *detail; /* Always a string constant */
+  unsigned char event;
+  unsigned char group;
+  int values[4];
+};
+
+struct XBeeResumePage {
+  unsigned long address;
+  unsigned int length;
+  unsigned int crc;
+};
+
 struct XBeeBootSession {
   struct serial_device *serialDevice;
   union filedescriptor serialDescriptor;
@@ -217,9 +446,73 @@ struct XBeeBootSession {
 
   int xbeeResetPin;
 
+  /*
+   * Options for the ZigBee Transmit Requests carrying XBeeBoot
+   * packets, and the XBeeBoot retransmit timeout (milliseconds, zero
+   * for the serial timeout) and number of attempts.
+   */
+  unsigned char transmitOptions;
+  long retransmitTimeout;
+  int retransmitLimit;
+
+  /*
+   * Set to non-zero if the running application handed over to the
+   * bootloader, so the reset pin was never used.
+   */
+  int appEntry;
+
+  /*
+   * XBEEBOOT_FEATURE_* bitmap reported by the bootloader, zero if it
+   * has no extensions.
+   */
+  unsigned char bootFeatures;
+
+  /*
+   * Word address of the last page journaled by the bootloader during
+   * an interrupted update.  -1 if there is none.
+   */
+  long journalPage;
+
+  /*
+   * Flash pages the bootloader takes in one STK_PROG_PAGE, zero
+   * unless it supports XBEEBOOT_FEATURE_MULTI_PAGE.
+   */
+  unsigned char bootPages;
+
+  /*
+   * XBEEBOOT_COUNTER_* values read from the bootloader just before it
+   * left programming mode, if bootCountersRead is set.
+   */
+  unsigned char bootCounters[XBEEBOOT_COUNTERS];
+  int bootCountersRead;
+
+  /*
+   * Flash already written (aheadWritten set) or read ahead of avrdude
+   * asking, as [aheadStart, aheadEnd) of aheadMem, whose buffer was
+   * aheadBuf.  avrdude must ask for it in order, starting at
+   * aheadStart.  aheadMem is NULL if none.
+   */
+  AVRMEM *aheadMem;
+  unsigned char *aheadBuf;
+  unsigned long aheadStart;
+  unsigned long aheadEnd;
+  int aheadWritten;
+
+  /*
+   * Received data queued for xbeedev_recv(), held in
+   * inBuffer[inOutIndex, inInIndex).  inBuffer is allocated and grown
+   * as needed.
+   */
   size_t inInIndex;
   size_t inOutIndex;
-  unsigned char inBuffer[256];
+  size_t inBufferSize;
+  unsigned char *inBuffer;
+
+  /*
+   * If non-zero, xbeedev_poll() gives up when no frame has started
+   * within this many milliseconds, rather than the serial timeout.
+   */
+  long quietTimeout;
 
   int sourceRouteHops; /* -1 if unset */
   int sourceRouteChanged;
@@ -231,89 +524,156 @@ struct XBeeBootSession {
    */
   unsigned char sourceRoute[2 * XBEE_MAX_INTERMEDIATE_HOPS];
 
+  /*
+   * Resume support.  The state file records every flash page the
+   * bootloader has acknowledged writing, and resumePages holds the
+   * pages recorded there by an earlier, interrupted, session.
+   */
+  char *resumeFile;
+  FILE *resumeLog;
+  struct XBeeResumePage *resumePages;
+  size_t resumePageCount;
+  unsigned int resumeSkipped;
+
+  /* API frames written to the local XBee, and how many were retries */
+  unsigned long framesSent;
+  unsigned long framesRetried;
+
+  /*
+   * Chrome trace event JSON written for xbeetrace, and the number of
+   * events written to it so far.  NULL if not tracing.
+   */
+  FILE *traceFile;
+  unsigned long traceEvents;
+
+  /* pcap file written for xbeecapture, NULL if not capturing */
+  FILE *captureFile;
+
+  /*
+   * pcap file read for xbeereplay, in place of the serial device.
+   * Received frames are released replaySpeed times as fast as they
+   * were captured, counting from replayStart and the first frame's
+   * timestamp.  replayBuffer holds a frame read but not yet received.
+   */
+  FILE *replayFile;
+  double replaySpeed;
+  uint64_t replayStart;
+  double replayFirst;
+  unsigned char replayBuffer[2 * 256 + 1];
+  size_t replayIndex;
+  size_t replayLength;
+
+#if XBEE_LOG_ENTRIES > 0
+  struct XBeeLogEntry log[XBEE_LOG_ENTRIES];
+  unsigned long logNext; /* Events logged */
+  unsigned long logShown; /* Events already formatted */
+#endif
+
   struct XBeeSequenceStatistics sequenceStatistics[256 * XBEE_STATS_GROUPS];
   struct XBeeStaticticsSummary groupSummary[XBEE_STATS_GROUPS];
+
+  /* XBEE_STATS_COMMAND again, by opcode */
+  struct XBeeStaticticsSummary commandSummary[256];
 };
 
 static void xbeeStatsReset(struct XBeeStaticticsSummary *summary)
 {
-  summary->minimum.tv_sec = 0;
-  summary->minimum.tv_usec = 0;
-  summary->maximum.tv_sec = 0;
-  summary->maximum.tv_usec = 0;
-  summary->sum.tv_sec = 0;
-  summary->sum.tv_usec = 0;
+  summary->minimum = 0;
+  summary->maximum = 0;
+  summary->sum = 0;
   summary->samples = 0;
 }
 
 static void xbeeStatsAdd(struct XBeeStaticticsSummary *summary,
-                         struct timeval const *sample)
+                         uint64_t sample)
 {
-  summary->sum.tv_usec += sample->tv_usec;
-  if (summary->sum.tv_usec > 1000000) {
-    summary->sum.tv_usec -= 1000000;
-    summary->sum.tv_sec++;
-  }
-  summary->sum.tv_sec += sample->tv_sec;
+  summary->sum += sample;
 
-  if (summary->samples == 0 ||
-      summary->minimum.tv_sec > sample->tv_sec ||
-      (summary->minimum.tv_sec == sample->tv_sec &&
-       summary->minimum.tv_usec > sample->tv_usec)) {
-    summary->minimum = *sample;
-  }
+  if (summary->samples == 0 || summary->minimum > sample)
+    summary->minimum = sample;
 
-  if (summary->maximum.tv_sec < sample->tv_sec ||
-      (summary->maximum.tv_sec == sample->tv_sec &&
-       summary->maximum.tv_usec < sample->tv_usec)) {
-    summary->maximum = *sample;
-  }
+  if (summary->maximum < sample)
+    summary->maximum = sample;
 
   summary->samples++;
 }
 
 static void xbeeStatsSummarise(struct XBeeStaticticsSummary const *summary)
 {
-  avrdude_message(MSG_NOTICE, "%s:   Minimum response time: %lu.%06lu\n",
-                  progname, summary->minimum.tv_sec, summary->minimum.tv_usec);
-  avrdude_message(MSG_NOTICE, "%s:   Maximum response time: %lu.%06lu\n",
-                  progname, summary->maximum.tv_sec, summary->maximum.tv_usec);
-
-  struct timeval average;
+  if (summary->samples == 0) {
+    avrdude_message(MSG_NOTICE, "%s:   No responses\n", progname);
+    return;
+  }
 
-  const unsigned long samples = summary->samples;
-  average.tv_sec = summary->sum.tv_sec / samples;
+  avrdude_message(MSG_NOTICE, "%s:   Minimum response time: "
+                  XBEE_NS_FORMAT "\n",
+                  progname, XBEE_NS_ARGS(summary->minimum));
+  avrdude_message(MSG_NOTICE, "%s:   Maximum response time: "
+                  XBEE_NS_FORMAT "\n",
+                  progname, XBEE_NS_ARGS(summary->maximum));
 
-  unsigned long long usecs = summary->sum.tv_usec;
-  usecs += (summary->sum.tv_sec % samples) * 1000000;
-  usecs = usecs / samples;
-  average.tv_sec += usecs / 1000000;
-  average.tv_usec = usecs % 1000000;
+  const uint64_t average = summary->sum / summary->samples;
 
-  avrdude_message(MSG_NOTICE, "%s:   Average response time: %lu.%06lu\n",
-                  progname, average.tv_sec, average.tv_usec);
+  avrdude_message(MSG_NOTICE, "%s:   Average response time: "
+                  XBEE_NS_FORMAT "\n",
+                  progname, XBEE_NS_ARGS(average));
 }
 
 static void XBeeBootSessionInit(struct XBeeBootSession *xbs) {
   xbs->serialDevice = &serial_serdev;
   xbs->directMode = 1;
   xbs->xbeeResetPin = XBEE_DEFAULT_RESET_PIN;
+  xbs->transmitOptions = 0;
+  xbs->retransmitTimeout = 0;
+  xbs->retransmitLimit = XBEE_MAX_RETRIES;
   xbs->outSequence = 0;
   xbs->inSequence = 0;
   xbs->txSequence = 0;
   xbs->transportUnusable = 0;
+  xbs->bootFeatures = 0;
+  xbs->journalPage = -1;
+  xbs->bootPages = 0;
+  xbs->bootCountersRead = 0;
+  xbs->aheadMem = NULL;
+  xbs->aheadBuf = NULL;
+  xbs->aheadWritten = 0;
   xbs->inInIndex = 0;
   xbs->inOutIndex = 0;
+  xbs->inBufferSize = 0;
+  xbs->inBuffer = NULL;
+  xbs->quietTimeout = 0;
   xbs->sourceRouteHops = -1;
   xbs->sourceRouteChanged = 0;
+  xbs->resumeFile = NULL;
+  xbs->resumeLog = NULL;
+  xbs->resumePages = NULL;
+  xbs->resumePageCount = 0;
+  xbs->resumeSkipped = 0;
+  xbs->appEntry = 0;
+  xbs->framesSent = 0;
+  xbs->framesRetried = 0;
+  xbs->traceFile = NULL;
+  xbs->traceEvents = 0;
+  xbs->captureFile = NULL;
+  xbs->replayFile = NULL;
+  xbs->replayIndex = 0;
+  xbs->replayLength = 0;
+#if XBEE_LOG_ENTRIES > 0
+  xbs->logNext = 0;
+  xbs->logShown = 0;
+#endif
 
   int group;
-  for (group = 0; group < 3; group++) {
+  for (group = 0; group < XBEE_STATS_GROUPS; group++) {
     int index;
     for (index = 0; index < 256; index++)
-      xbs->sequenceStatistics[group * 256 + index].sendTime.tv_sec = (time_t)0;
+      xbs->sequenceStatistics[group * 256 + index].sendTime = 0;
     xbeeStatsReset(&xbs->groupSummary[group]);
   }
+
+  int opcode;
+  for (opcode = 0; opcode < 256; opcode++)
+    xbeeStatsReset(&xbs->commandSummary[opcode]);
 }
 
 #define xbeebootsession(fdp) (struct XBeeBootSession*)((fdp)->pfd)
@@ -327,162 +687,758 @@ static void xbeedev_setresetpin(union filedescriptor *fdp, int xbeeResetPin)
 enum xbee_stat_is_retry_enum {XBEE_STATS_NOT_RETRY, XBEE_STATS_IS_RETRY};
 typedef enum xbee_stat_is_retry_enum xbee_stat_is_retry;
 
-static void xbeedev_stats_send(struct XBeeBootSession *xbs,
-                               char const *detail,
-                               int detailSequence,
-                               unsigned int group, unsigned char sequence,
-                               xbee_stat_is_retry retry,
-                               struct timeval const *sendTime)
+/*
+ * Frame timestamps in nanoseconds, from the monotonic clock where there
+ * is one, so that response times aren't upset by the system time being
+ * adjusted.
+ */
+static uint64_t xbeeClock(void)
 {
-  struct XBeeSequenceStatistics *stats =
-    &xbs->sequenceStatistics[group * 256 + sequence];
+#ifdef CLOCK_MONOTONIC
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+#else
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_usec * 1000;
+#endif
+}
 
-  if (retry == XBEE_STATS_NOT_RETRY)
-    stats->sendTime = *sendTime;
-
-  if (detailSequence >= 0) {
-    avrdude_message(MSG_NOTICE2,
-                    "%s: Stats: Send Group %s Sequence %u : "
-                    "Send %lu.%06lu %s Sequence %d\n",
-                    progname, groupNames[group],
-                    (unsigned int)sequence,
-                    (unsigned long)sendTime->tv_sec,
-                    (unsigned long)sendTime->tv_usec,
-                    detail, detailSequence);
-  } else {
-    avrdude_message(MSG_NOTICE2,
-                    "%s: Stats: Send Group %s Sequence %u : "
-                    "Send %lu.%06lu %s\n",
-                    progname, groupNames[group],
-                    (unsigned int)sequence,
-                    (unsigned long)sendTime->tv_sec,
-                    (unsigned long)sendTime->tv_usec,
-                    detail);
+/*
+ * The xbeetrace file, in Chrome's trace event format (chrome://tracing
+ * or https://ui.perfetto.dev).  Each statistics group is a thread,
+ * with a complete event for each send timed to its response.  One
+ * more thread has an instant event for every API frame sent or
+ * received.
+ */
+#define XBEE_TRACE_FRAMES XBEE_STATS_GROUPS
+
+static void xbeeTraceEvent(struct XBeeBootSession *xbs, char const *name,
+                           unsigned int thread,
+                           uint64_t start, uint64_t const *duration,
+                           char const *argsFormat, ...)
+{
+  if (xbs->traceFile == NULL)
+    return;
+
+  fprintf(xbs->traceFile,
+          "%s{\"name\":\"%s\",\"pid\":1,\"tid\":%u,\"ts\":%llu.%03u,",
+          xbs->traceEvents++ == 0 ? "" : ",\n", name, thread,
+          (unsigned long long)(start / 1000), (unsigned int)(start % 1000));
+  if (duration != NULL)
+    fprintf(xbs->traceFile, "\"ph\":\"X\",\"dur\":%llu.%03u,",
+            (unsigned long long)(*duration / 1000),
+            (unsigned int)(*duration % 1000));
+  else
+    fprintf(xbs->traceFile, "\"ph\":\"i\",\"s\":\"t\",");
+
+  va_list ap;
+  va_start(ap, argsFormat);
+  fprintf(xbs->traceFile, "\"args\":{");
+  vfprintf(xbs->traceFile, argsFormat, ap);
+  fprintf(xbs->traceFile, "}}");
+  va_end(ap);
+}
+
+static int xbeeTraceOpen(struct XBeeBootSession *xbs, char const *filename)
+{
+  xbs->traceFile = fopen(filename, "w");
+  if (xbs->traceFile == NULL) {
+    avrdude_message(MSG_INFO, "%s: Unable to write trace to %s\n",
+                    progname, filename);
+    return -1;
   }
+
+  fprintf(xbs->traceFile, "[\n");
+
+  /* Name the threads */
+  unsigned int thread;
+  for (thread = 0; thread <= XBEE_TRACE_FRAMES; thread++)
+    fprintf(xbs->traceFile,
+            "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+            "\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+            xbs->traceEvents++ == 0 ? "" : ",\n", thread,
+            thread < XBEE_STATS_GROUPS ? groupNames[thread] : "FRAMES");
+
+  return 0;
 }
 
-static void xbeedev_stats_receive(struct XBeeBootSession *xbs,
-                                  char const *detail,
-                                  unsigned int group, unsigned char sequence,
-                                  struct timeval const *receiveTime)
+static void xbeeTraceClose(struct XBeeBootSession *xbs)
 {
-  struct XBeeSequenceStatistics *stats =
-    &xbs->sequenceStatistics[group * 256 + sequence];
-  struct timeval delay;
-  time_t secs;
-  long usecs;
+  if (xbs->traceFile == NULL)
+    return;
+
+  fprintf(xbs->traceFile, "\n]\n");
+  fclose(xbs->traceFile);
+  xbs->traceFile = NULL;
+}
 
-  secs = receiveTime->tv_sec - stats->sendTime.tv_sec;
-  usecs = receiveTime->tv_usec - stats->sendTime.tv_usec;
+/*
+ * The xbeecapture file is pcap, with nanosecond timestamps and the
+ * first user link type.  Each packet is a direction byte, then the
+ * API frame from its 0x7e start byte to its checksum, unescaped.
+ */
+#define XBEE_PCAP_MAGIC 0xa1b23c4d
+#define XBEE_PCAP_LINKTYPE 147 /* LINKTYPE_USER0 */
+#define XBEE_PCAP_SENT 0 /* To the local XBee */
+#define XBEE_PCAP_RECEIVED 1 /* From the local XBee */
 
-  if (usecs < 0) {
-    usecs += 1000000;
-    secs--;
+static int xbeeCaptureOpen(struct XBeeBootSession *xbs, char const *filename)
+{
+  xbs->captureFile = fopen(filename, "wb");
+  if (xbs->captureFile == NULL) {
+    avrdude_message(MSG_INFO, "%s: Unable to write capture to %s\n",
+                    progname, filename);
+    return -1;
   }
 
-  delay.tv_sec = secs;
-  delay.tv_usec = usecs;
+  const uint32_t header[6] = {
+    XBEE_PCAP_MAGIC,
+    2 | 4 << 16, /* Version 2.4 */
+    0, /* Timezone */
+    0, /* Accuracy */
+    65535, /* Snapshot length */
+    XBEE_PCAP_LINKTYPE
+  };
+  fwrite(header, sizeof(header), 1, xbs->captureFile);
+  return 0;
+}
 
-  avrdude_message(MSG_NOTICE2,
-                  "%s: Stats: Receive Group %s Sequence %u : "
-                  "Send %lu.%06lu Receive %lu.%06lu Delay %lu.%06lu %s\n",
-                  progname, groupNames[group],
-                  (unsigned int)sequence,
-                  (unsigned long)stats->sendTime.tv_sec,
-                  (unsigned long)stats->sendTime.tv_usec,
-                  (unsigned long)receiveTime->tv_sec,
-                  (unsigned long)receiveTime->tv_usec,
-                  (unsigned long)secs,
-                  (unsigned long)usecs,
-                  detail);
+/*
+ * Capture an API frame, given from the byte after its 0x7e, and
+ * escaped as it is on the wire if escaped is set.
+ */
+static void xbeeCaptureFrame(struct XBeeBootSession *xbs,
+                             unsigned char direction,
+                             const unsigned char *frame, size_t length,
+                             int escaped)
+{
+  if (xbs->captureFile == NULL)
+    return;
+
+  unsigned char packet[2 + 2 * 256];
+  size_t packetLength = 0;
+  packet[packetLength++] = direction;
+  packet[packetLength++] = 0x7e;
+
+  size_t index;
+  for (index = 0; index < length && packetLength < sizeof(packet); index++)
+    if (escaped && frame[index] == 0x7d && index + 1 < length)
+      packet[packetLength++] = frame[++index] ^ 0x20;
+    else
+      packet[packetLength++] = frame[index];
+
+  uint32_t record[4];
+#ifdef CLOCK_REALTIME
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  record[0] = now.tv_sec;
+  record[1] = now.tv_nsec;
+#else
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  record[0] = now.tv_sec;
+  record[1] = now.tv_usec * 1000;
+#endif
+  record[2] = record[3] = packetLength;
 
-  xbeeStatsAdd(&xbs->groupSummary[group], &delay);
+  fwrite(record, sizeof(record), 1, xbs->captureFile);
+  fwrite(packet, packetLength, 1, xbs->captureFile);
 }
 
-static int sendAPIRequest(struct XBeeBootSession *xbs,
-                          unsigned char apiType,
-                          int txSequence,
-                          int apiOption,
-                          int prePayload1,
-                          int prePayload2,
-                          int packetType,
-                          int sequence,
-                          int appType,
-                          char const *detail,
-                          int detailSequence,
-                          unsigned int frameGroup,
-                          xbee_stat_is_retry retry,
-                          unsigned int dataLength,
-                          const unsigned char *data)
+/*
+ * The xbeereplay stand-in for the serial device.  Frames we send are
+ * thrown away, and the frames received in the capture are received
+ * again, each no earlier than it was captured relative to the first.
+ * Replaying only follows the capture if we make the same requests, so
+ * it needs the same avrdude command line, options and bootloader.
+ *
+ * The session is found through the file descriptor, which xbeedev_open
+ * sets up before opening.
+ */
+static int xbeeReplayOpen(char *port, union pinfo pinfo,
+                          union filedescriptor *fdp)
 {
-  unsigned char frame[256];
+  struct XBeeBootSession *xbs = fdp->pfd;
+  uint32_t header[6];
 
-  unsigned char *fp = &frame[5];
-  unsigned char *dataStart = fp;
-  unsigned char checksum = 0xff;
-  unsigned char length = 0;
-  struct timeval time;
+  xbs->replayFile = fopen(xbeeExtParams.replayFile, "rb");
+  if (xbs->replayFile == NULL) {
+    avrdude_message(MSG_INFO, "%s: Unable to read capture %s\n",
+                    progname, xbeeExtParams.replayFile);
+    return -1;
+  }
 
-  gettimeofday(&time, NULL);
+  if (fread(header, sizeof(header), 1, xbs->replayFile) != 1 ||
+      header[0] != XBEE_PCAP_MAGIC || header[5] != XBEE_PCAP_LINKTYPE) {
+    avrdude_message(MSG_INFO, "%s: %s is not an xbeecapture file\n",
+                    progname, xbeeExtParams.replayFile);
+    fclose(xbs->replayFile);
+    return -1;
+  }
 
-  avrdude_message(MSG_NOTICE2,
-                  "%s: sendAPIRequest(): %lu.%06lu %d, %d, %d, %d %s\n",
-                  progname, (unsigned long)time.tv_sec,
-                  (unsigned long)time.tv_usec,
-                  (int)packetType, (int)sequence, appType,
-                  data == NULL ? -1 : (int)*data, detail);
+  xbs->replaySpeed = xbeeExtParams.replaySpeed;
+  xbs->replayFirst = -1;
+  xbs->replayStart = xbeeClock();
 
-#define fpput(x)                                                \
-  do {                                                          \
-    const unsigned char v = (x);                                \
-    if (v == 0x7d || v == 0x7e || v == 0x11 || v == 0x13) {     \
-      *fp++ = 0x7d;                                             \
-      *fp++ = v ^ 0x20;                                         \
-    } else {                                                    \
-      *fp++ = v;                                                \
-    }                                                           \
-    checksum -= v;                                              \
-    length++;                                                   \
-  } while (0)
+  avrdude_message(MSG_NOTICE, "%s: Replaying %s instead of %s\n",
+                  progname, xbeeExtParams.replayFile, port);
+  return 0;
+}
 
-  fpput(apiType); /* ZigBee Receive Packet or ZigBee Transmit Request */
+static void xbeeReplayClose(union filedescriptor *fdp)
+{
+  struct XBeeBootSession *xbs = fdp->pfd;
+  fclose(xbs->replayFile);
+}
 
-  if (apiOption >= 0)
-    fpput(apiOption); /* Receive options (RX) */
+static int xbeeReplaySend(union filedescriptor *fdp,
+                          const unsigned char *buf, size_t buflen)
+{
+  return 0;
+}
 
-  if (txSequence >= 0) {
-    fpput(txSequence); /* Delivery sequence (TX/AT) */
+/*
+ * Read the next received frame into replayBuffer, escaped again, once
+ * it is due.  Return -1 at the end of the capture, or if the frame
+ * isn't due within serial_recv_timeout.
+ */
+static int xbeeReplayNext(struct XBeeBootSession *xbs)
+{
+  uint32_t record[4];
+  unsigned char packet[2 + 2 * 256];
 
-    /*
-     * Record the frame send time.  Note that frame sequences are
-     * never retries.
-     */
-    xbeedev_stats_send(xbs, detail, detailSequence,
-                       frameGroup, txSequence, 0, &time);
+  do {
+    if (fread(record, sizeof(record), 1, xbs->replayFile) != 1 ||
+        record[2] > sizeof(packet) ||
+        fread(packet, record[2], 1, xbs->replayFile) != 1)
+      return -1;
+  } while (record[2] < 2 || packet[0] != XBEE_PCAP_RECEIVED);
+
+  const double captured = record[0] + record[1] / 1e9;
+  if (xbs->replayFirst < 0)
+    xbs->replayFirst = captured;
+
+  if (xbs->replaySpeed > 0) {
+    const double elapsed = (xbeeClock() - xbs->replayStart) / 1e9;
+    const double wait =
+      (captured - xbs->replayFirst) / xbs->replaySpeed - elapsed;
+
+    if (wait * 1000 > serial_recv_timeout) {
+      /* Timed out as it would have been, but keep the frame for later */
+      usleep(serial_recv_timeout * 1000);
+      fseek(xbs->replayFile, -(long)(sizeof(record) + record[2]), SEEK_CUR);
+      return -1;
+    }
+    if (wait > 0)
+      usleep(wait * 1e6);
   }
 
-  if (apiType != 0x08) {
-    /* Automatically inhibit addressing for local AT command requests. */
-    size_t index;
-    for (index = 0; index < 10; index++) {
-      const unsigned char val = xbs->xbee_address[index];
-      fpput(val);
+  size_t index;
+  xbs->replayLength = 0;
+  xbs->replayBuffer[xbs->replayLength++] = 0x7e;
+  for (index = 2; index < record[2]; index++) {
+    const unsigned char v = packet[index];
+    if (v == 0x7d || v == 0x7e || v == 0x11 || v == 0x13) {
+      xbs->replayBuffer[xbs->replayLength++] = 0x7d;
+      xbs->replayBuffer[xbs->replayLength++] = v ^ 0x20;
+    } else {
+      xbs->replayBuffer[xbs->replayLength++] = v;
     }
+  }
+  xbs->replayIndex = 0;
+  return 0;
+}
 
-    /*
-     * If this is an API call with remote address, but is not a Create
-     * Source Route request, consider prefixing it with source routing
-     * instructions.
-     */
-    if (apiType != 0x21 && xbs->sourceRouteChanged) {
-      avrdude_message(MSG_NOTICE2, "%s: sendAPIRequest(): "
-                      "Issuing Create Source Route request with %d hops\n",
-                      progname, xbs->sourceRouteHops);
+static int xbeeReplayRecv(union filedescriptor *fdp,
+                          unsigned char *buf, size_t buflen)
+{
+  struct XBeeBootSession *xbs = fdp->pfd;
 
-      int rc = sendAPIRequest(xbs, 0x21, /* Create Source Route */
-                              0, -1, 0, xbs->sourceRouteHops,
-                              -1, -1, -1,
-                              "Create Source Route for FRAME_REMOTE",
+  while (buflen > 0) {
+    if (xbs->replayIndex == xbs->replayLength &&
+        xbeeReplayNext(xbs) < 0)
+      return -1;
+
+    size_t length = xbs->replayLength - xbs->replayIndex;
+    if (length > buflen)
+      length = buflen;
+    memcpy(buf, &xbs->replayBuffer[xbs->replayIndex], length);
+    xbs->replayIndex += length;
+    buf += length;
+    buflen -= length;
+  }
+
+  return 0;
+}
+
+static int xbeeReplayDrain(union filedescriptor *fdp, int display)
+{
+  return 0;
+}
+
+static int xbeeReplaySetDtrRts(union filedescriptor *fdp, int is_on)
+{
+  return 0;
+}
+
+static struct serial_device xbeeReplayDevice = {
+  .open = xbeeReplayOpen,
+  .close = xbeeReplayClose,
+  .send = xbeeReplaySend,
+  .recv = xbeeReplayRecv,
+  .drain = xbeeReplayDrain,
+  .set_dtr_rts = xbeeReplaySetDtrRts,
+  .flags = SERDEV_FL_NONE,
+};
+
+static void xbeeLogFormat(struct XBeeLogEntry const *entry, int msglvl)
+{
+  const int *const value = entry->values;
+
+  switch (entry->event) {
+  case XBEE_LOG_API_REQUEST:
+    avrdude_message(msglvl,
+                    "%s: sendAPIRequest(): " XBEE_NS_FORMAT " %d, %d, %d, %d %s\n",
+                    progname, XBEE_NS_ARGS(entry->time),
+                    value[0], value[1], value[2], value[3], entry->detail);
+    break;
+
+  case XBEE_LOG_STATS_SEND:
+    if (value[1] >= 0)
+      avrdude_message(msglvl,
+                      "%s: Stats: Send Group %s Sequence %u : "
+                      "Send " XBEE_NS_FORMAT " %s Sequence %d\n",
+                      progname, groupNames[entry->group],
+                      (unsigned int)value[0], XBEE_NS_ARGS(entry->time),
+                      entry->detail, value[1]);
+    else
+      avrdude_message(msglvl,
+                      "%s: Stats: Send Group %s Sequence %u : "
+                      "Send " XBEE_NS_FORMAT " %s\n",
+                      progname, groupNames[entry->group],
+                      (unsigned int)value[0], XBEE_NS_ARGS(entry->time),
+                      entry->detail);
+    break;
+
+  case XBEE_LOG_STATS_RECEIVE: {
+    /* Recover the send time from the delay */
+    const uint64_t delay =
+      (uint64_t)value[1] * 1000000000 + (unsigned int)value[2];
+
+    avrdude_message(msglvl,
+                    "%s: Stats: Receive Group %s Sequence %u : "
+                    "Send " XBEE_NS_FORMAT " Receive " XBEE_NS_FORMAT
+                    " Delay " XBEE_NS_FORMAT " %s\n",
+                    progname, groupNames[entry->group],
+                    (unsigned int)value[0],
+                    XBEE_NS_ARGS(entry->time - delay),
+                    XBEE_NS_ARGS(entry->time), XBEE_NS_ARGS(delay),
+                    entry->detail);
+    break;
+  }
+
+  case XBEE_LOG_FRAME:
+    avrdude_message(msglvl,
+                    "%s: xbeedev_poll(): " XBEE_NS_FORMAT
+                    " Received frame type %x\n",
+                    progname, XBEE_NS_ARGS(entry->time), (unsigned int)value[0]);
+    break;
+
+  case XBEE_LOG_BAD_CHECKSUM:
+    avrdude_message(msglvl,
+                    "%s: xbeedev_poll(): " XBEE_NS_FORMAT " Bad checksum %d\n",
+                    progname, XBEE_NS_ARGS(entry->time), value[0]);
+    break;
+
+  case XBEE_LOG_TRANSMIT_STATUS:
+    avrdude_message(msglvl,
+                    "%s: xbeedev_poll(): Transmit status %d result code %d\n",
+                    progname, value[0], value[1]);
+    break;
+
+  case XBEE_LOG_PACKET:
+    avrdude_message(msglvl, "%s: xbeedev_poll(): "
+                    XBEE_NS_FORMAT " Packet %d #%d\n",
+                    progname, XBEE_NS_ARGS(entry->time), value[0], value[1]);
+    break;
+  }
+}
+
+/*
+ * Log a hot path event.  Without -vv this is only a copy into the
+ * ring.
+ */
+static void xbeeLog(struct XBeeBootSession *xbs, unsigned char event,
+                    unsigned int group, uint64_t time,
+                    char const *detail, int value0, int value1,
+                    int value2, int value3)
+{
+#if XBEE_LOG_ENTRIES > 0
+  struct XBeeLogEntry *entry =
+    &xbs->log[xbs->logNext++ & (XBEE_LOG_ENTRIES - 1)];
+#else
+  struct XBeeLogEntry local;
+  struct XBeeLogEntry *entry = &local;
+#endif
+
+  entry->time = time;
+  entry->detail = detail;
+  entry->event = event;
+  entry->group = group;
+  entry->values[0] = value0;
+  entry->values[1] = value1;
+  entry->values[2] = value2;
+  entry->values[3] = value3;
+
+  if (verbose >= MSG_NOTICE2) {
+    xbeeLogFormat(entry, MSG_NOTICE2);
+#if XBEE_LOG_ENTRIES > 0
+    xbs->logShown = xbs->logNext;
+#endif
+  }
+}
+
+/*
+ * Show the events leading up to a failure, unless they were already
+ * shown as they happened.
+ */
+static void xbeeLogDump(struct XBeeBootSession *xbs)
+{
+#if XBEE_LOG_ENTRIES > 0
+  unsigned long first = xbs->logShown;
+  if (xbs->logNext - first > XBEE_LOG_ENTRIES)
+    first = xbs->logNext - XBEE_LOG_ENTRIES;
+
+  if (first == xbs->logNext)
+    return;
+
+  avrdude_message(MSG_INFO, "%s: The last %lu XBee events were:\n",
+                  progname, xbs->logNext - first);
+  for (; first != xbs->logNext; first++)
+    xbeeLogFormat(&xbs->log[first & (XBEE_LOG_ENTRIES - 1)], MSG_INFO);
+
+  xbs->logShown = xbs->logNext;
+#endif
+}
+
+static void xbeedev_stats_send(struct XBeeBootSession *xbs,
+                               char const *detail,
+                               int detailSequence,
+                               unsigned int group, unsigned char sequence,
+                               xbee_stat_is_retry retry,
+                               uint64_t sendTime)
+{
+  struct XBeeSequenceStatistics *stats =
+    &xbs->sequenceStatistics[group * 256 + sequence];
+
+  if (retry == XBEE_STATS_NOT_RETRY) {
+    stats->sendTime = sendTime;
+    stats->retries = 0;
+  } else {
+    stats->retries++;
+  }
+
+  xbeeLog(xbs, XBEE_LOG_STATS_SEND, group, sendTime, detail,
+          sequence, detailSequence >= 0 ? detailSequence : -1, 0, 0);
+}
+
+static void xbeedev_stats_receive(struct XBeeBootSession *xbs,
+                                  char const *detail,
+                                  unsigned int group, unsigned char sequence,
+                                  uint64_t receiveTime)
+{
+  struct XBeeSequenceStatistics *stats =
+    &xbs->sequenceStatistics[group * 256 + sequence];
+  const uint64_t delay = receiveTime - stats->sendTime;
+
+  xbeeLog(xbs, XBEE_LOG_STATS_RECEIVE, group, receiveTime, detail,
+          sequence, (int)(delay / 1000000000), (int)(delay % 1000000000), 0);
+
+  xbeeTraceEvent(xbs, detail, group, stats->sendTime, &delay,
+                 "\"sequence\":%u,\"retries\":%u,\"hops\":%d",
+                 (unsigned int)sequence, stats->retries,
+                 xbs->sourceRouteHops);
+
+  xbeeStatsAdd(&xbs->groupSummary[group], delay);
+  if (group == XBEE_STATS_COMMAND)
+    xbeeStatsAdd(&xbs->commandSummary[sequence], delay);
+}
+
+/*
+ * Time an STK500 command from sending it to the end of its response,
+ * which includes the target's flash time as well as the radio's.
+ */
+static void xbeedev_stats_command(struct XBeeBootSession *xbs,
+                                  unsigned char opcode)
+{
+  xbeedev_stats_send(xbs, "STK500 command", opcode, XBEE_STATS_COMMAND,
+                     opcode, XBEE_STATS_NOT_RETRY, xbeeClock());
+}
+
+static void xbeedev_stats_response(struct XBeeBootSession *xbs,
+                                   unsigned char opcode)
+{
+  xbeedev_stats_receive(xbs, "STK500 response", XBEE_STATS_COMMAND,
+                        opcode, xbeeClock());
+}
+
+/*
+ * Bulk kernels for the API mode 2 framing.  A frame payload is mostly
+ * bytes that pass through untouched, so rather than testing each byte
+ * in turn these find the next byte needing attention a block at a
+ * time, and checksum with a horizontal add.  On x86 the SSE2 or AVX2
+ * version is picked on first use, anywhere else the scalar version is
+ * used.
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define XBEE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+/*
+ * Index of the first byte in data that is an escape (0x7d) or frame
+ * delimiter (0x7e), or with xonxoff non-zero also an XON (0x11) or
+ * XOFF (0x13); length if there is none.
+ */
+static size_t xbeeScanScalar(const unsigned char *data, size_t length,
+                             int xonxoff)
+{
+  size_t index;
+  for (index = 0; index < length; index++) {
+    const unsigned char v = data[index];
+    if (v == 0x7d || v == 0x7e || (xonxoff && (v == 0x11 || v == 0x13)))
+      break;
+  }
+  return index;
+}
+
+/* Sum of the bytes in data, modulo 256 */
+static unsigned char xbeeSumScalar(const unsigned char *data, size_t length)
+{
+  unsigned char sum = 0;
+  while (length-- > 0)
+    sum += *data++;
+  return sum;
+}
+
+#ifdef XBEE_X86_KERNELS
+__attribute__((target("sse2")))
+static size_t xbeeScanSSE2(const unsigned char *data, size_t length,
+                           int xonxoff)
+{
+  const __m128i escape = _mm_set1_epi8(0x7d);
+  const __m128i flag = _mm_set1_epi8(0x7e);
+  /* Without XON/XOFF, just compare against the delimiter again */
+  const __m128i xon = _mm_set1_epi8(xonxoff ? 0x11 : 0x7e);
+  const __m128i xoff = _mm_set1_epi8(xonxoff ? 0x13 : 0x7e);
+
+  size_t index;
+  for (index = 0; index + 16 <= length; index += 16) {
+    const __m128i v = _mm_loadu_si128((const __m128i *)&data[index]);
+    const __m128i hit =
+      _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, escape),
+                                _mm_cmpeq_epi8(v, flag)),
+                   _mm_or_si128(_mm_cmpeq_epi8(v, xon),
+                                _mm_cmpeq_epi8(v, xoff)));
+    const int mask = _mm_movemask_epi8(hit);
+    if (mask != 0)
+      return index + __builtin_ctz(mask);
+  }
+
+  return index + xbeeScanScalar(&data[index], length - index, xonxoff);
+}
+
+__attribute__((target("sse2")))
+static unsigned char xbeeSumSSE2(const unsigned char *data, size_t length)
+{
+  const __m128i zero = _mm_setzero_si128();
+  __m128i sum = zero;
+
+  size_t index;
+  for (index = 0; index + 16 <= length; index += 16) {
+    const __m128i v = _mm_loadu_si128((const __m128i *)&data[index]);
+    sum = _mm_add_epi64(sum, _mm_sad_epu8(v, zero));
+  }
+  sum = _mm_add_epi64(sum, _mm_unpackhi_epi64(sum, sum));
+
+  return (unsigned char)_mm_cvtsi128_si32(sum) +
+    xbeeSumScalar(&data[index], length - index);
+}
+
+__attribute__((target("avx2")))
+static size_t xbeeScanAVX2(const unsigned char *data, size_t length,
+                           int xonxoff)
+{
+  const __m256i escape = _mm256_set1_epi8(0x7d);
+  const __m256i flag = _mm256_set1_epi8(0x7e);
+  const __m256i xon = _mm256_set1_epi8(xonxoff ? 0x11 : 0x7e);
+  const __m256i xoff = _mm256_set1_epi8(xonxoff ? 0x13 : 0x7e);
+
+  size_t index;
+  for (index = 0; index + 32 <= length; index += 32) {
+    const __m256i v = _mm256_loadu_si256((const __m256i *)&data[index]);
+    const __m256i hit =
+      _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, escape),
+                                      _mm256_cmpeq_epi8(v, flag)),
+                      _mm256_or_si256(_mm256_cmpeq_epi8(v, xon),
+                                      _mm256_cmpeq_epi8(v, xoff)));
+    const unsigned int mask = _mm256_movemask_epi8(hit);
+    if (mask != 0) {
+      _mm256_zeroupper();
+      return index + __builtin_ctz(mask);
+    }
+  }
+
+  /*
+   * The compiler doesn't reliably clear the upper halves before the
+   * call, and leaving them dirty stalls every later SSE instruction.
+   */
+  _mm256_zeroupper();
+  return index + xbeeScanSSE2(&data[index], length - index, xonxoff);
+}
+
+__attribute__((target("avx2")))
+static unsigned char xbeeSumAVX2(const unsigned char *data, size_t length)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i sum = zero;
+
+  size_t index;
+  for (index = 0; index + 32 <= length; index += 32) {
+    const __m256i v = _mm256_loadu_si256((const __m256i *)&data[index]);
+    sum = _mm256_add_epi64(sum, _mm256_sad_epu8(v, zero));
+  }
+
+  __m128i half = _mm_add_epi64(_mm256_castsi256_si128(sum),
+                               _mm256_extracti128_si256(sum, 1));
+  half = _mm_add_epi64(half, _mm_unpackhi_epi64(half, half));
+  _mm256_zeroupper();
+
+  return (unsigned char)_mm_cvtsi128_si32(half) +
+    xbeeSumSSE2(&data[index], length - index);
+}
+#endif
+
+static size_t xbeeScanResolve(const unsigned char *data, size_t length,
+                              int xonxoff);
+static unsigned char xbeeSumResolve(const unsigned char *data,
+                                    size_t length);
+
+static size_t (*xbeeScan)(const unsigned char *data, size_t length,
+                          int xonxoff) = xbeeScanResolve;
+static unsigned char (*xbeeSum)(const unsigned char *data,
+                                size_t length) = xbeeSumResolve;
+
+static void xbeeKernelsSelect(void)
+{
+  xbeeScan = xbeeScanScalar;
+  xbeeSum = xbeeSumScalar;
+
+#ifdef XBEE_X86_KERNELS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    xbeeScan = xbeeScanAVX2;
+    xbeeSum = xbeeSumAVX2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    xbeeScan = xbeeScanSSE2;
+    xbeeSum = xbeeSumSSE2;
+  }
+#endif
+}
+
+static size_t xbeeScanResolve(const unsigned char *data, size_t length,
+                              int xonxoff)
+{
+  xbeeKernelsSelect();
+  return xbeeScan(data, length, xonxoff);
+}
+
+static unsigned char xbeeSumResolve(const unsigned char *data, size_t length)
+{
+  xbeeKernelsSelect();
+  return xbeeSum(data, length);
+}
+
+static int sendAPIRequest(struct XBeeBootSession *xbs,
+                          unsigned char apiType,
+                          int txSequence,
+                          int apiOption,
+                          int prePayload1,
+                          int prePayload2,
+                          int packetType,
+                          int sequence,
+                          int appType,
+                          char const *detail,
+                          int detailSequence,
+                          unsigned int frameGroup,
+                          xbee_stat_is_retry retry,
+                          unsigned int dataLength,
+                          const unsigned char *data)
+{
+  unsigned char frame[256];
+
+  unsigned char *fp = &frame[5];
+  unsigned char *dataStart = fp;
+  unsigned char checksum = 0xff;
+  unsigned char length = 0;
+  const uint64_t time = xbeeClock();
+
+  xbeeLog(xbs, XBEE_LOG_API_REQUEST, frameGroup, time, detail,
+          packetType, sequence, appType, data == NULL ? -1 : (int)*data);
+
+#define fpput(x)                                                \
+  do {                                                          \
+    const unsigned char v = (x);                                \
+    if (v == 0x7d || v == 0x7e || v == 0x11 || v == 0x13) {     \
+      *fp++ = 0x7d;                                             \
+      *fp++ = v ^ 0x20;                                         \
+    } else {                                                    \
+      *fp++ = v;                                                \
+    }                                                           \
+    checksum -= v;                                              \
+    length++;                                                   \
+  } while (0)
+
+  fpput(apiType); /* ZigBee Receive Packet or ZigBee Transmit Request */
+
+  if (apiOption >= 0)
+    fpput(apiOption); /* Receive options (RX) */
+
+  if (txSequence >= 0) {
+    fpput(txSequence); /* Delivery sequence (TX/AT) */
+
+    /*
+     * Record the frame send time.  Note that frame sequences are
+     * never retries.
+     */
+    xbeedev_stats_send(xbs, detail, detailSequence,
+                       frameGroup, txSequence, 0, time);
+  }
+
+  if (apiType != 0x08) {
+    /* Automatically inhibit addressing for local AT command requests. */
+    size_t index;
+    for (index = 0; index < 10; index++) {
+      const unsigned char val = xbs->xbee_address[index];
+      fpput(val);
+    }
+
+    /*
+     * If this is an API call with remote address, but is not a Create
+     * Source Route request, consider prefixing it with source routing
+     * instructions.
+     */
+    if (apiType != 0x21 && xbs->sourceRouteChanged) {
+      avrdude_message(MSG_NOTICE2, "%s: sendAPIRequest(): "
+                      "Issuing Create Source Route request with %d hops\n",
+                      progname, xbs->sourceRouteHops);
+
+      int rc = sendAPIRequest(xbs, 0x21, /* Create Source Route */
+                              0, -1, 0, xbs->sourceRouteHops,
+                              -1, -1, -1,
+                              "Create Source Route for FRAME_REMOTE",
                               txSequence,
                               XBEE_STATS_FRAME_LOCAL, /* Local, no response */
                               0, /* Not a retry */
@@ -510,16 +1466,37 @@ static int sendAPIRequest(struct XBeeBootSession *xbs,
     /* Record the send time */
     if (packetType == XBEEBOOT_PACKET_TYPE_REQUEST)
       xbeedev_stats_send(xbs, detail, sequence, XBEE_STATS_TRANSMIT,
-                         sequence, retry, &time);
+                         sequence, retry, time);
   }
 
   if (appType >= 0)
     fpput(appType); /* FIRMWARE_DELIVER */
 
   {
-    size_t index;
-    for (index = 0; index < dataLength; index++)
-      fpput(data[index]);
+    /*
+     * The payload is the bulk of the frame, so copy it across in runs
+     * between the bytes needing escapes, and checksum it in one go.
+     */
+    checksum -= xbeeSum(data, dataLength);
+    length += dataLength;
+
+    size_t index = 0;
+    while (index < dataLength) {
+      const unsigned char v = data[index];
+      if (v == 0x7d || v == 0x7e || v == 0x11 || v == 0x13) {
+        *fp++ = 0x7d;
+        *fp++ = v ^ 0x20;
+        index++;
+        continue;
+      }
+
+      /* Copy this byte and the run of plain bytes following it */
+      const size_t run = 1 + xbeeScan(&data[index + 1],
+                                      dataLength - index - 1, 1);
+      memcpy(fp, &data[index], run);
+      fp += run;
+      index += run;
+    }
   }
 
   /* Length BEFORE checksum byte */
@@ -538,6 +1515,20 @@ static int sendAPIRequest(struct XBeeBootSession *xbs,
   unsigned char *frameStart = dataStart - prefixLength;
   memmove(frameStart, frame, prefixLength);
 
+  xbs->framesSent++;
+  if (retry == XBEE_STATS_IS_RETRY)
+    xbs->framesRetried++;
+
+  xbeeCaptureFrame(xbs, XBEE_PCAP_SENT, frameStart + 1,
+                   finalLength + prefixLength - 1, 1);
+
+  xbeeTraceEvent(xbs, detail, XBEE_TRACE_FRAMES, time, NULL,
+                 "\"api\":%u,\"frame\":%d,\"sequence\":%d,"
+                 "\"retry\":%d,\"size\":%u,\"hops\":%d",
+                 (unsigned int)apiType, txSequence, sequence,
+                 retry == XBEE_STATS_IS_RETRY,
+                 finalLength + prefixLength, xbs->sourceRouteHops);
+
   return xbs->serialDevice->send(&xbs->serialDescriptor,
                                  frameStart, finalLength + prefixLength);
 }
@@ -572,7 +1563,7 @@ static int sendPacket(struct XBeeBootSession *xbs,
      */
     apiType = 0x10; /* ZigBee Transmit Request */
     prePayload1 = 0;
-    prePayload2 = 0;
+    prePayload2 = xbs->transmitOptions;
   }
 
   while ((++xbs->txSequence & 0xff) == 0);
@@ -614,11 +1605,67 @@ static void xbeedev_record16Bit(struct XBeeBootSession *xbs,
   }
 }
 
+static int xbeedev_read(struct XBeeBootSession *xbs,
+                        unsigned char *buf, size_t buflen)
+{
+  return xbs->serialDevice->recv(&xbs->serialDescriptor, buf, buflen);
+}
+
+/*
+ * Make room in the receive queue for another length bytes.  Return 0
+ * on success, or -1 if the queue is full.
+ */
+static int xbeedev_reserve(struct XBeeBootSession *xbs, size_t length)
+{
+  const size_t queued = xbs->inInIndex - xbs->inOutIndex;
+  if (queued + length > XBEE_MAX_RECEIVE_QUEUE)
+    return -1;
+
+  if (xbs->inBufferSize - xbs->inInIndex >= length)
+    return 0;
+
+  if (queued > 0)
+    memmove(xbs->inBuffer, &xbs->inBuffer[xbs->inOutIndex], queued);
+  xbs->inOutIndex = 0;
+  xbs->inInIndex = queued;
+
+  if (xbs->inBufferSize - queued >= length)
+    return 0;
+
+  size_t size = xbs->inBufferSize > 0 ? xbs->inBufferSize : 256;
+  while (size - queued < length)
+    size *= 2;
+
+  unsigned char *buffer = realloc(xbs->inBuffer, size);
+  if (buffer == NULL)
+    return -1;
+
+  xbs->inBuffer = buffer;
+  xbs->inBufferSize = size;
+  return 0;
+}
+
+/*
+ * As xbeedev_read(), but giving up after timeout milliseconds.
+ */
+static int xbeedev_readWithin(struct XBeeBootSession *xbs,
+                              unsigned char *buf, size_t buflen,
+                              long timeout)
+{
+  const long serialTimeout = serial_recv_timeout;
+  serial_recv_timeout = timeout;
+  const int rc = xbeedev_read(xbs, buf, buflen);
+  serial_recv_timeout = serialTimeout;
+  return rc;
+}
+
 /*
  * Return 0 on success.
  * Return -1 on generic error (normally serial timeout).
+ * Return XBEE_POLL_BUSY if the bootloader was busy, waiting for an ACK.
  * Return -512 + XBee AT Response code
  */
+#define XBEE_POLL_BUSY -2
 #define XBEE_AT_RETURN_CODE(x) (((x) >= -512 && (x) <= -256) ? (x) + 512 : -1)
 static int xbeedev_poll(struct XBeeBootSession *xbs,
                         unsigned char **buf, size_t *buflen,
@@ -629,10 +1676,13 @@ static int xbeedev_poll(struct XBeeBootSession *xbs,
     unsigned char byte;
     unsigned char frame[256];
     unsigned int frameSize;
+    uint64_t receiveTime; /* Read once per frame */
 
   before_frame:
     do {
-      const int rc = xbs->serialDevice->recv(&xbs->serialDescriptor, &byte, 1);
+      const int rc = xbs->quietTimeout > 0 ?
+        xbeedev_readWithin(xbs, &byte, 1, xbs->quietTimeout) :
+        xbeedev_read(xbs, &byte, 1);
       if (rc < 0)
         return rc;
     } while (byte != 0x7e);
@@ -643,8 +1693,11 @@ static int xbeedev_poll(struct XBeeBootSession *xbs,
       int escaped = 0;
       frameSize = XBEE_LENGTH_LEN;
       do {
-        const int rc = xbs->serialDevice->recv(&xbs->serialDescriptor,
-                                               &byte, 1);
+        /*
+         * A byte at a time, so that a frame cut short on the wire
+         * never holds up the frame after it.
+         */
+        const int rc = xbeedev_read(xbs, &byte, 1);
         if (rc < 0)
           return rc;
 
@@ -663,9 +1716,6 @@ static int xbeedev_poll(struct XBeeBootSession *xbs,
           continue;
         }
 
-        if (index >= sizeof(frame))
-          goto before_frame;
-
         frame[index++] = byte;
 
         if (index == XBEE_LENGTH_LEN) {
@@ -680,31 +1730,29 @@ static int xbeedev_poll(struct XBeeBootSession *xbs,
       } while (index < frameSize);
 
       /* End of frame */
-      unsigned char checksum = 1;
-      size_t cIndex;
-      for (cIndex = 2; cIndex < index; cIndex++) {
-        checksum += frame[cIndex];
-      }
+      xbeeCaptureFrame(xbs, XBEE_PCAP_RECEIVED, frame, index, 0);
+      receiveTime = xbeeClock();
+
+      const unsigned char checksum =
+        1 + xbeeSum(&frame[XBEE_LENGTH_LEN], index - XBEE_LENGTH_LEN);
 
       if (checksum) {
         /* Checksum didn't match */
-        avrdude_message(MSG_NOTICE2,
-                        "%s: xbeedev_poll(): Bad checksum %d\n",
-                        progname, (int)checksum);
+        xbeeLog(xbs, XBEE_LOG_BAD_CHECKSUM, 0, receiveTime,
+                NULL, checksum, 0, 0, 0);
         continue;
       }
     }
 
     const unsigned char frameType = frame[2];
 
-    struct timeval receiveTime;
-    gettimeofday(&receiveTime, NULL);
+    xbeeLog(xbs, XBEE_LOG_FRAME, 0, receiveTime, NULL,
+            frameType, 0, 0, 0);
 
-    avrdude_message(MSG_NOTICE2,
-                    "%s: xbeedev_poll(): %lu.%06lu Received frame type %x\n",
-                    progname, (unsigned long)receiveTime.tv_sec,
-                    (unsigned long)receiveTime.tv_usec,
-                    (unsigned int)frameType);
+    xbeeTraceEvent(xbs, "Received frame", XBEE_TRACE_FRAMES, receiveTime,
+                   NULL, "\"api\":%u,\"size\":%u,\"hops\":%d",
+                   (unsigned int)frameType, frameSize,
+                   xbs->sourceRouteHops);
 
     if (frameType == 0x97 && frameSize > 16) {
       /* Remote command response */
@@ -712,7 +1760,7 @@ static int xbeedev_poll(struct XBeeBootSession *xbs,
       unsigned char resultCode = frame[16];
 
       xbeedev_stats_receive(xbs, "Remote AT command response",
-                            XBEE_STATS_FRAME_REMOTE, txSequence, &receiveTime);
+                            XBEE_STATS_FRAME_REMOTE, txSequence, receiveTime);
 
       avrdude_message(MSG_NOTICE,
                       "%s: xbeedev_poll(): Remote command %d result code %d\n",
@@ -726,7 +1774,7 @@ static int xbeedev_poll(struct XBeeBootSession *xbs,
       unsigned char txSequence = frame[3];
 
       xbeedev_stats_receive(xbs, "Local AT command response",
-                            XBEE_STATS_FRAME_LOCAL, txSequence, &receiveTime);
+                            XBEE_STATS_FRAME_LOCAL, txSequence, receiveTime);
 
       avrdude_message(MSG_NOTICE,
                       "%s: xbeedev_poll(): Local command %c%c result code %d\n",
@@ -740,11 +1788,10 @@ static int xbeedev_poll(struct XBeeBootSession *xbs,
       unsigned char txSequence = frame[3];
 
       xbeedev_stats_receive(xbs, "Transmit status", XBEE_STATS_FRAME_REMOTE,
-                            txSequence, &receiveTime);
+                            txSequence, receiveTime);
 
-      avrdude_message(MSG_NOTICE2,
-                      "%s: xbeedev_poll(): Transmit status %d result code %d\n",
-                      progname, (int)frame[3], (int)frame[7]);
+      xbeeLog(xbs, XBEE_LOG_TRANSMIT_STATUS, XBEE_STATS_FRAME_REMOTE,
+              receiveTime, NULL, frame[3], frame[7], 0, 0);
     } else if (frameType == 0xa1 &&
                frameSize >= XBEE_LENGTH_LEN + XBEE_APITYPE_LEN +
                XBEE_ADDRESS_64BIT_LEN +
@@ -866,17 +1913,14 @@ static int xbeedev_poll(struct XBeeBootSession *xbs,
         const unsigned char protocolType = dataStart[0];
         const unsigned char sequence = dataStart[1];
 
-        avrdude_message(MSG_NOTICE2, "%s: xbeedev_poll(): "
-                        "%lu.%06lu Packet %d #%d\n",
-                        progname, (unsigned long)receiveTime.tv_sec,
-                        (unsigned long)receiveTime.tv_usec,
-                        (int)protocolType, (int)sequence);
+        xbeeLog(xbs, XBEE_LOG_PACKET, 0, receiveTime, NULL,
+                protocolType, sequence, 0, 0);
 
         if (protocolType == XBEEBOOT_PACKET_TYPE_ACK) {
           /* ACK */
           xbeedev_stats_receive(xbs, "XBeeBoot ACK",
                                 XBEE_STATS_TRANSMIT, sequence,
-                                &receiveTime);
+                                receiveTime);
 
           /*
            * We can't update outSequence here, we already do that
@@ -884,36 +1928,55 @@ static int xbeedev_poll(struct XBeeBootSession *xbs,
            */
           if (waitForAck >= 0 && waitForAck == sequence)
             return 0;
+        } else if (protocolType == XBEEBOOT_PACKET_TYPE_BUSY) {
+          /* The bootloader couldn't take our request yet */
+          if (waitForAck >= 0 && waitForAck == sequence)
+            return XBEE_POLL_BUSY;
         } else if (protocolType == XBEEBOOT_PACKET_TYPE_REQUEST &&
                    dataLength >= 4 && dataStart[2] == 24) {
           /* REQUEST FRAME_REPLY */
           xbeedev_stats_receive(xbs, "XBeeBoot Receive", XBEE_STATS_RECEIVE,
-                                sequence, &receiveTime);
+                                sequence, receiveTime);
 
           unsigned char nextSequence = xbs->inSequence;
           while ((++nextSequence & 0xff) == 0);
           if (sequence == nextSequence) {
+            const unsigned char *text = &dataStart[3];
+            size_t textLength = dataLength - 3;
+
+            /*
+             * If we are receiving right now, and have a buffer, fill
+             * that first.  Queue the rest.
+             */
+            size_t direct = 0;
+            if (buflen != NULL)
+              direct = textLength < *buflen ? textLength : *buflen;
+
+            if (xbeedev_reserve(xbs, textLength - direct) < 0) {
+              /*
+               * No room to queue it, so don't ACK it.  The bootloader
+               * will send it again, and by then xbeedev_recv() should
+               * have caught up.
+               */
+              avrdude_message(MSG_NOTICE2, "%s: xbeedev_poll(): "
+                              "Receive queue full, not ACKing #%d\n",
+                              progname, (int)sequence);
+              continue;
+            }
+
             xbs->inSequence = nextSequence;
 
-            const size_t textLength = dataLength - 3;
-            size_t index;
-            for (index = 0; index < textLength; index++) {
-              const unsigned char data = dataStart[3 + index];
-              if (buflen != NULL && *buflen > 0) {
-                /* If we are receiving right now, and have a buffer... */
-                *(*buf)++ = data;
-                (*buflen)--;
-              } else {
-                xbs->inBuffer[xbs->inInIndex++] = data;
-                if (xbs->inInIndex == sizeof(xbs->inBuffer))
-                  xbs->inInIndex = 0;
-                if (xbs->inInIndex == xbs->inOutIndex) {
-                  /* Should be impossible */
-                  avrdude_message(MSG_INFO, "%s: Buffer overrun\n", progname);
-                  xbs->transportUnusable = 1;
-                  return -1;
-                }
-              }
+            if (direct > 0) {
+              memcpy(*buf, text, direct);
+              *buf += direct;
+              *buflen -= direct;
+              text += direct;
+              textLength -= direct;
+            }
+
+            if (textLength > 0) {
+              memcpy(&xbs->inBuffer[xbs->inInIndex], text, textLength);
+              xbs->inInIndex += textLength;
             }
 
             /*avrdude_message(MSG_INFO, "ACK %x\n", (unsigned int)sequence);*/
@@ -936,9 +1999,18 @@ static int xbeedev_poll(struct XBeeBootSession *xbs,
                                nextSequence,
                                XBEE_STATS_RECEIVE,
                                nextSequence, XBEE_STATS_NOT_RETRY,
-                               &receiveTime);
-          }
-        }
+                               receiveTime);
+          } else if (sequence == xbs->inSequence) {
+            /*
+             * The bootloader sent this one again, so our ACK was
+             * probably lost.  ACK it again straight away, rather than
+             * leave it waiting on our next retry.
+             */
+            sendPacket(xbs, "Transmit Request ACK [Duplicate] for RECEIVE",
+                       XBEEBOOT_PACKET_TYPE_ACK, sequence,
+                       XBEE_STATS_IS_RETRY, -1, 0, NULL);
+          }
+        }
       }
     }
   }
@@ -1097,6 +2169,14 @@ static int xbeeATError(int rc) {
 static void xbeedev_free(struct XBeeBootSession *xbs)
 {
   xbs->serialDevice->close(&xbs->serialDescriptor);
+  if (xbs->resumeLog != NULL)
+    fclose(xbs->resumeLog);
+  xbeeTraceClose(xbs);
+  if (xbs->captureFile != NULL)
+    fclose(xbs->captureFile);
+  free(xbs->resumePages);
+  free(xbs->resumeFile);
+  free(xbs->inBuffer);
   free(xbs);
 }
 
@@ -1239,6 +2319,11 @@ static int xbeedev_open(char *port, union pinfo pinfo,
 
   avrdude_message(MSG_NOTICE, "%s: Baud %ld\n", progname, (long)pinfo.baud);
 
+  if (xbeeExtParams.replayFile != NULL) {
+    xbs->serialDevice = &xbeeReplayDevice;
+    xbs->serialDescriptor.pfd = xbs;
+  }
+
   {
     const int rc = xbs->serialDevice->open(tty, pinfo,
                                            &xbs->serialDescriptor);
@@ -1248,6 +2333,12 @@ static int xbeedev_open(char *port, union pinfo pinfo,
     }
   }
 
+  if (xbeeExtParams.captureFile != NULL &&
+      xbeeCaptureOpen(xbs, xbeeExtParams.captureFile) < 0) {
+    xbeedev_free(xbs);
+    return -1;
+  }
+
   if (!xbs->directMode) {
     /* Attempt to ensure the local XBee is in API mode 2 */
     {
@@ -1255,6 +2346,7 @@ static int xbeedev_open(char *port, union pinfo pinfo,
       if (rc < 0) {
         avrdude_message(MSG_INFO, "%s: Local XBee is not responding.\n",
                         progname);
+        xbeeLogDump(xbs);
         xbeedev_free(xbs);
         return rc;
       }
@@ -1296,6 +2388,7 @@ static int xbeedev_open(char *port, union pinfo pinfo,
       if (rc < 0) {
         avrdude_message(MSG_INFO, "%s: Local XBee is not responding.\n",
                         progname);
+        xbeeLogDump(xbs);
         xbeedev_free(xbs);
         return rc;
       }
@@ -1312,13 +2405,15 @@ static int xbeedev_open(char *port, union pinfo pinfo,
      */
     const int rc = sendAT(xbs, "AT D6=0", 'D', '6', 0);
     if (rc < 0) {
-      xbeedev_free(xbs);
-
-      if (xbeeATError(rc))
+      if (xbeeATError(rc)) {
+        xbeedev_free(xbs);
         return -1;
+      }
 
       avrdude_message(MSG_INFO, "%s: Remote XBee is not responding.\n",
                       progname);
+      xbeeLogDump(xbs);
+      xbeedev_free(xbs);
       return rc;
     }
   }
@@ -1328,6 +2423,24 @@ static int xbeedev_open(char *port, union pinfo pinfo,
   return 0;
 }
 
+/*
+ * Poll for an XBeeBoot ACK or reply, giving up after the retransmit
+ * timeout.
+ */
+static int xbeedev_pollPacket(struct XBeeBootSession *xbs,
+                              unsigned char **buf, size_t *buflen,
+                              int waitForAck)
+{
+  if (xbs->retransmitTimeout == 0)
+    return xbeedev_poll(xbs, buf, buflen, waitForAck, -1);
+
+  const long timeout = serial_recv_timeout;
+  serial_recv_timeout = xbs->retransmitTimeout;
+  const int rc = xbeedev_poll(xbs, buf, buflen, waitForAck, -1);
+  serial_recv_timeout = timeout;
+  return rc;
+}
+
 static int xbeedev_send(union filedescriptor *fdp,
                         const unsigned char *buf, size_t buflen)
 {
@@ -1353,9 +2466,6 @@ static int xbeedev_send(union filedescriptor *fdp,
       unsigned char nextSequence = xbs->inSequence;
       while ((++nextSequence & 0xff) == 0);
 
-      struct timeval sendTime;
-      gettimeofday(&sendTime, NULL);
-
       /*
        * Optimistic records should never be treated as retries,
        * because they might simply be guessing too optimistically.
@@ -1363,7 +2473,7 @@ static int xbeedev_send(union filedescriptor *fdp,
       xbeedev_stats_send(xbs, "send() hints possible triggered RECEIVE",
                          nextSequence,
                          XBEE_STATS_RECEIVE,
-                         nextSequence, 0, &sendTime);
+                         nextSequence, 0, xbeeClock());
     }
 
     /*
@@ -1388,15 +2498,17 @@ static int xbeedev_send(union filedescriptor *fdp,
       (buflen > maximum_chunk) ? maximum_chunk : buflen;
 
     int pollRc = 0;
+    int busy = 0;
 
     /* Repeatedly send whilst timing out waiting for ACK responses. */
     int retries;
-    for (retries = 0; retries < XBEE_MAX_RETRIES; retries++) {
+    for (retries = 0; retries < xbs->retransmitLimit; retries++) {
       int sendRc =
         sendPacket(xbs,
                    "Transmit Request Data, expect ACK for TRANSMIT",
                    XBEEBOOT_PACKET_TYPE_REQUEST, sequence,
-                   retries > 0 ? XBEE_STATS_IS_RETRY : XBEE_STATS_NOT_RETRY,
+                   retries > 0 || busy > 0 ?
+                   XBEE_STATS_IS_RETRY : XBEE_STATS_NOT_RETRY,
                    23 /* FIRMWARE_DELIVER */,
                    blockLength, buf);
       if (sendRc < 0) {
@@ -1405,7 +2517,7 @@ static int xbeedev_send(union filedescriptor *fdp,
         return sendRc;
       }
 
-      pollRc = xbeedev_poll(xbs, NULL, NULL, sequence, -1);
+      pollRc = xbeedev_pollPacket(xbs, NULL, NULL, sequence);
       if (pollRc == 0) {
         /* Send was ACK'd */
         buflen -= blockLength;
@@ -1413,6 +2525,24 @@ static int xbeedev_send(union filedescriptor *fdp,
         break;
       }
 
+      if (pollRc == XBEE_POLL_BUSY && busy++ < XBEE_MAX_BUSY) {
+        /*
+         * The bootloader got it, but is still waiting on an ACK from
+         * us before it can take any more.  Resend our last ACK, and
+         * then the data again in a moment, without counting a retry.
+         */
+        avrdude_message(MSG_NOTICE2, "%s: xbeedev_send(): "
+                        "XBeeBoot busy, retransmitting #%d\n",
+                        progname, (int)sequence);
+        retries--;
+        if (xbs->inSequence != 0)
+          sendPacket(xbs, "Transmit Request ACK [Busy in send] for RECEIVE",
+                     XBEEBOOT_PACKET_TYPE_ACK, xbs->inSequence,
+                     XBEE_STATS_IS_RETRY, -1, 0, NULL);
+        usleep(XBEE_BUSY_BACKOFF * 1000);
+        continue;
+      }
+
       /*
        * Test the connection to the local XBee by repeatedly
        * requesting local configuration details.  This functionally
@@ -1445,6 +2575,7 @@ static int xbeedev_send(union filedescriptor *fdp,
     if (pollRc < 0) {
       /* There is no way to recover from a failure mid-send */
       xbs->transportUnusable = 1;
+      xbeeLogDump(xbs);
       return pollRc;
     }
   }
@@ -1461,11 +2592,16 @@ static int xbeedev_recv(union filedescriptor *fdp,
    * First de-buffer anything previously received in a chunk that
    * couldn't be immediately delievered.
    */
-  while (xbs->inInIndex != xbs->inOutIndex) {
-    *buf++ = xbs->inBuffer[xbs->inOutIndex++];
-    if (xbs->inOutIndex == sizeof(xbs->inBuffer))
-      xbs->inOutIndex = 0;
-    if (--buflen == 0)
+  if (xbs->inInIndex != xbs->inOutIndex) {
+    const size_t queued = xbs->inInIndex - xbs->inOutIndex;
+    const size_t length = queued < buflen ? queued : buflen;
+
+    memcpy(buf, &xbs->inBuffer[xbs->inOutIndex], length);
+    xbs->inOutIndex += length;
+    buf += length;
+    buflen -= length;
+
+    if (buflen == 0)
       return 0;
   }
 
@@ -1481,9 +2617,6 @@ static int xbeedev_recv(union filedescriptor *fdp,
     unsigned char nextSequence = xbs->inSequence;
     while ((++nextSequence & 0xff) == 0);
 
-    struct timeval sendTime;
-    gettimeofday(&sendTime, NULL);
-
     /*
      * Not a retry - in fact this is the first stage we know for sure
      * a RECEIVE is due.
@@ -1493,12 +2626,12 @@ static int xbeedev_recv(union filedescriptor *fdp,
                        XBEE_STATS_RECEIVE,
                        nextSequence,
                        XBEE_STATS_NOT_RETRY,
-                       &sendTime);
+                       xbeeClock());
   }
 
   int retries;
-  for (retries = 0; retries < XBEE_MAX_RETRIES; retries++) {
-    const int rc = xbeedev_poll(xbs, &buf, &buflen, -1, -1);
+  for (retries = 0; retries < xbs->retransmitLimit; retries++) {
+    const int rc = xbeedev_pollPacket(xbs, &buf, &buflen, -1);
     if (rc == 0)
       return 0;
 
@@ -1524,6 +2657,8 @@ static int xbeedev_recv(union filedescriptor *fdp,
                  XBEE_STATS_IS_RETRY,
                  -1, 0, NULL);
   }
+
+  xbeeLogDump(xbs);
   return -1;
 }
 
@@ -1537,11 +2672,16 @@ static int xbeedev_drain(union filedescriptor *fdp, int display)
 
   /*
    * Flushing the local serial buffer is unhelpful under this
-   * protocol.
+   * protocol.  Instead process every frame already received, or
+   * arriving within a short quiet window, so ACKs are still sent and
+   * sequence numbers and routes still tracked, and only then discard
+   * the data.
    */
-  do {
-    xbs->inOutIndex = xbs->inInIndex = 0;
-  } while (xbeedev_poll(xbs, NULL, NULL, -1, -1) == 0);
+  xbs->quietTimeout = XBEE_DRAIN_QUIET;
+  xbeedev_poll(xbs, NULL, NULL, -1, -1);
+  xbs->quietTimeout = 0;
+
+  xbs->inOutIndex = xbs->inInIndex = 0;
 
   return 0;
 }
@@ -1567,6 +2707,7 @@ static int xbeedev_set_dtr_rts(union filedescriptor *fdp, int is_on)
 
     avrdude_message(MSG_INFO,
                     "%s: Remote XBee is not responding.\n", progname);
+    xbeeLogDump(xbs);
     return rc;
   }
 
@@ -1586,6 +2727,21 @@ static struct serial_device xbee_serdev_frame = {
   .flags = SERDEV_FL_NONE,
 };
 
+/*
+ * Forget the transport state left by a failed exchange, ready to
+ * start over with a freshly reset bootloader.
+ */
+static void xbeedev_restart(union filedescriptor *fdp)
+{
+  struct XBeeBootSession *xbs = xbeebootsession(fdp);
+
+  xbs->outSequence = 0;
+  xbs->inSequence = 0;
+  xbs->inInIndex = 0;
+  xbs->inOutIndex = 0;
+  xbs->transportUnusable = 0;
+}
+
 static int xbee_getsync(PROGRAMMER *pgm)
 {
   unsigned char buf[2], resp[2];
@@ -1636,6 +2792,721 @@ static int xbee_getsync(PROGRAMMER *pgm)
   return 0;
 }
 
+/*
+ * CRC-16/CCITT of a page, used to recognise pages in the resume state
+ * file that hold the same data as the image being written now.
+ */
+static unsigned int xbeeCrc16(const unsigned char *data, size_t length)
+{
+  unsigned int crc = 0xffff;
+  while (length-- > 0) {
+    int bit;
+    crc ^= (unsigned int)*data++ << 8;
+    for (bit = 0; bit < 8; bit++)
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    crc &= 0xffff;
+  }
+  return crc;
+}
+
+/*
+ * Start the resume state file afresh with the pages loaded from it,
+ * leaving it open for xbeeResumeCheckpoint() to append to.  The pages
+ * are written to a new file that then replaces the old one, so that
+ * an interruption now loses nothing.
+ */
+static int xbeeResumeRewrite(struct XBeeBootSession *xbs)
+{
+  const size_t nameLength = strlen(xbs->resumeFile) + 5;
+  char *newFile = malloc(nameLength);
+  if (newFile == NULL) {
+    avrdude_message(MSG_INFO, "%s: xbeeResumeRewrite(): out of memory\n",
+                    progname);
+    return -1;
+  }
+  snprintf(newFile, nameLength, "%s.new", xbs->resumeFile);
+
+  FILE *state = fopen(newFile, "w");
+  if (state == NULL) {
+    avrdude_message(MSG_INFO, "%s: Unable to write resume state to %s\n",
+                    progname, newFile);
+    free(newFile);
+    return -1;
+  }
+
+  fprintf(state, "# XBeeBoot resume state\n");
+  size_t index;
+  for (index = 0; index < xbs->resumePageCount; index++) {
+    const struct XBeeResumePage *page = &xbs->resumePages[index];
+    fprintf(state, "flash 0x%05lx %u 0x%04x\n",
+            page->address, page->length, page->crc);
+  }
+
+  /* Some platforms won't rename over an existing file */
+  if (fflush(state) != 0 ||
+      (rename(newFile, xbs->resumeFile) != 0 &&
+       (remove(xbs->resumeFile) != 0 ||
+        rename(newFile, xbs->resumeFile) != 0))) {
+    avrdude_message(MSG_INFO, "%s: Unable to write resume state to %s\n",
+                    progname, xbs->resumeFile);
+    fclose(state);
+    remove(newFile);
+    free(newFile);
+    return -1;
+  }
+
+  free(newFile);
+  xbs->resumeLog = state;
+  return 0;
+}
+
+/*
+ * Load the pages recorded by earlier sessions from the resume state
+ * file, the last record of each page replacing any before it, and
+ * rewrite the file with just those.  A missing state file simply means
+ * there is nothing to resume.
+ */
+static int xbeeResumeLoad(struct XBeeBootSession *xbs, char const *file)
+{
+  if (file != NULL) {
+    xbs->resumeFile = strdup(file);
+  } else {
+    /* Default to a per-node file in the current directory */
+    const unsigned char *a = xbs->xbee_address;
+    char name[64];
+    snprintf(name, sizeof(name),
+             "xbeeboot-%02x%02x%02x%02x%02x%02x%02x%02x.resume",
+             a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7]);
+    xbs->resumeFile = strdup(name);
+  }
+
+  if (xbs->resumeFile == NULL) {
+    avrdude_message(MSG_INFO, "%s: xbeeResumeLoad(): out of memory\n",
+                    progname);
+    return -1;
+  }
+
+  FILE *state = fopen(xbs->resumeFile, "r");
+  if (state == NULL)
+    return 0;
+
+  char line[128];
+  while (fgets(line, sizeof(line), state) != NULL) {
+    unsigned long address;
+    unsigned int length, crc;
+    if (sscanf(line, "flash %lx %u %x", &address, &length, &crc) != 3)
+      /* Comments, or a line torn by the interruption */
+      continue;
+
+    size_t index;
+    for (index = 0; index < xbs->resumePageCount; index++)
+      if (xbs->resumePages[index].address == address)
+        break;
+
+    if (index < xbs->resumePageCount) {
+      /* Rewritten by a later session */
+      xbs->resumePages[index].length = length;
+      xbs->resumePages[index].crc = crc;
+      continue;
+    }
+
+    struct XBeeResumePage *pages =
+      realloc(xbs->resumePages,
+              (xbs->resumePageCount + 1) * sizeof(*xbs->resumePages));
+    if (pages == NULL) {
+      avrdude_message(MSG_INFO, "%s: xbeeResumeLoad(): out of memory\n",
+                      progname);
+      fclose(state);
+      return -1;
+    }
+    xbs->resumePages = pages;
+    pages[xbs->resumePageCount].address = address;
+    pages[xbs->resumePageCount].length = length;
+    pages[xbs->resumePageCount].crc = crc;
+    xbs->resumePageCount++;
+  }
+
+  fclose(state);
+
+  avrdude_message(MSG_INFO, "%s: Resuming from %s: %lu pages recorded\n",
+                  progname, xbs->resumeFile,
+                  (unsigned long)xbs->resumePageCount);
+
+  return xbeeResumeRewrite(xbs);
+}
+
+/*
+ * Return non-zero if an earlier session recorded writing this page
+ * with this content.
+ */
+static int xbeeResumeFind(struct XBeeBootSession const *xbs,
+                          unsigned long address, unsigned int length,
+                          unsigned int crc)
+{
+  if (xbs->bootFeatures & XBEEBOOT_FEATURE_JOURNAL) {
+    /*
+     * The bootloader journal has the final say.  If it has no
+     * interrupted update, the target has been updated since our
+     * state file was written.  The journal trails the update by a
+     * few pages, so pages beyond it are sent again.
+     */
+    if (xbs->journalPage < 0 ||
+        address > (unsigned long)xbs->journalPage * 2)
+      return 0;
+  }
+
+  size_t index;
+  for (index = 0; index < xbs->resumePageCount; index++) {
+    const struct XBeeResumePage *page = &xbs->resumePages[index];
+    if (page->address == address && page->length == length &&
+        page->crc == crc)
+      return 1;
+  }
+
+  return 0;
+}
+
+/*
+ * Record a page acknowledged by the bootloader in the resume state
+ * file, flushing immediately so that it survives the interruption.
+ */
+static void xbeeResumeCheckpoint(struct XBeeBootSession *xbs,
+                                 unsigned long address, unsigned int length,
+                                 unsigned int crc)
+{
+  if (xbs->resumeLog == NULL) {
+    xbs->resumeLog = fopen(xbs->resumeFile, "a");
+    if (xbs->resumeLog == NULL) {
+      avrdude_message(MSG_INFO, "%s: Unable to write resume state to %s\n",
+                      progname, xbs->resumeFile);
+      /* Carry on without checkpoints */
+      free(xbs->resumeFile);
+      xbs->resumeFile = NULL;
+      return;
+    }
+
+    fprintf(xbs->resumeLog, "# XBeeBoot resume state\n");
+  }
+
+  fprintf(xbs->resumeLog, "flash 0x%05lx %u 0x%04x\n", address, length, crc);
+  fflush(xbs->resumeLog);
+}
+
+/*
+ * Read flash directly, without disturbing the memory image buffer.
+ * The address and read commands are issued together, so that they are
+ * delivered in a single frame.
+ */
+static int xbee_read_flash(PROGRAMMER *pgm, unsigned long address,
+                           unsigned char *data, unsigned int length)
+{
+  unsigned char buf[9];
+  const unsigned long word = address / 2;
+
+  buf[0] = Cmnd_STK_LOAD_ADDRESS;
+  buf[1] = word & 0xff;
+  buf[2] = (word >> 8) & 0xff;
+  buf[3] = Sync_CRC_EOP;
+  buf[4] = Cmnd_STK_READ_PAGE;
+  buf[5] = (length >> 8) & 0xff;
+  buf[6] = length & 0xff;
+  buf[7] = 'F';
+  buf[8] = Sync_CRC_EOP;
+
+  if (serial_send(&pgm->fd, buf, 9) < 0)
+    return -1;
+
+  /* LOAD_ADDRESS INSYNC, OK and READ_PAGE INSYNC */
+  if (serial_recv(&pgm->fd, buf, 3) < 0)
+    return -1;
+  if (buf[0] != Resp_STK_INSYNC || buf[1] != Resp_STK_OK ||
+      buf[2] != Resp_STK_INSYNC) {
+    avrdude_message(MSG_INFO, "%s: xbee_read_flash(): protocol error, "
+                    "resp=0x%02x 0x%02x 0x%02x\n",
+                    progname, (unsigned int)buf[0], (unsigned int)buf[1],
+                    (unsigned int)buf[2]);
+    return -2;
+  }
+
+  if (serial_recv(&pgm->fd, data, length) < 0)
+    return -1;
+
+  if (serial_recv(&pgm->fd, buf, 1) < 0)
+    return -1;
+  if (buf[0] != Resp_STK_OK) {
+    avrdude_message(MSG_INFO, "%s: xbee_read_flash(): protocol error, "
+                    "expect=0x%02x, resp=0x%02x\n",
+                    progname, Resp_STK_OK, (unsigned int)buf[0]);
+    return -2;
+  }
+
+  return 0;
+}
+
+/*
+ * Write flash pages, which must be consecutive and no more than the
+ * bootloader's bootPages.
+ *
+ * Unlike reads, LOAD_ADDRESS has to travel in a packet of its own.
+ * The bootloader sends its reply as soon as it has run a command, and
+ * can't accept the next packet until it has used up the last one.
+ * Sent alone, it leaves the packet buffer empty, so the program
+ * command streams in while the reply is still on its way to us.
+ */
+static int xbee_write_flash(PROGRAMMER *pgm, unsigned long address,
+                            const unsigned char *data, unsigned int length)
+{
+  unsigned char reply[4];
+  unsigned char *buf = malloc(length + 5);
+  if (buf == NULL) {
+    avrdude_message(MSG_INFO, "%s: xbee_write_flash(): out of memory\n",
+                    progname);
+    return -1;
+  }
+
+  const unsigned long word = address / 2;
+  buf[0] = Cmnd_STK_LOAD_ADDRESS;
+  buf[1] = word & 0xff;
+  buf[2] = (word >> 8) & 0xff;
+  buf[3] = Sync_CRC_EOP;
+
+  int rc = serial_send(&pgm->fd, buf, 4);
+  if (rc >= 0) {
+    buf[0] = Cmnd_STK_PROG_PAGE;
+    buf[1] = (length >> 8) & 0xff;
+    buf[2] = length & 0xff;
+    buf[3] = 'F';
+    memcpy(&buf[4], data, length);
+    buf[length + 4] = Sync_CRC_EOP;
+
+    rc = serial_send(&pgm->fd, buf, length + 5);
+  }
+  free(buf);
+  if (rc < 0)
+    return -1;
+
+  /* LOAD_ADDRESS INSYNC, OK and PROG_PAGE INSYNC, OK */
+  if (serial_recv(&pgm->fd, reply, 4) < 0)
+    return -1;
+  if (reply[0] != Resp_STK_INSYNC || reply[1] != Resp_STK_OK ||
+      reply[2] != Resp_STK_INSYNC || reply[3] != Resp_STK_OK) {
+    avrdude_message(MSG_INFO, "%s: xbee_write_flash(): protocol error, "
+                    "resp=0x%02x 0x%02x 0x%02x 0x%02x\n",
+                    progname, (unsigned int)reply[0], (unsigned int)reply[1],
+                    (unsigned int)reply[2], (unsigned int)reply[3]);
+    return -2;
+  }
+
+  return 0;
+}
+
+/*
+ * Return non-zero if avrdude has data for any of the page at addr.
+ */
+static int xbee_page_allocated(AVRMEM *m, unsigned int addr,
+                               unsigned int page_size)
+{
+  unsigned int index;
+  for (index = addr; index < addr + page_size; index++)
+    if (m->tags[index] & TAG_ALLOCATED)
+      return 1;
+  return 0;
+}
+
+/*
+ * Confirm that a page recorded by an earlier session is still present
+ * on the target.  Where the bootloader journal vouches for the update
+ * being the one interrupted, it is enough to read back a sample of the
+ * page, and the sampled bytes move from page to page.  Otherwise the
+ * target may have been programmed since by other means, so the whole
+ * page is read back.
+ *
+ * Return 0 if the page is confirmed, 1 if it differs, negative on
+ * error.
+ */
+static int xbee_confirm_page(PROGRAMMER *pgm, AVRMEM *m,
+                             unsigned int addr, unsigned int n_bytes)
+{
+  struct XBeeBootSession *xbs = xbeebootsession(&pgm->fd);
+  unsigned int length = n_bytes;
+  unsigned int offset = 0;
+
+  if ((xbs->bootFeatures & XBEEBOOT_FEATURE_JOURNAL) &&
+      n_bytes > XBEE_RESUME_SAMPLE) {
+    length = XBEE_RESUME_SAMPLE;
+    offset = (addr / n_bytes * length) % n_bytes;
+    if (offset + length > n_bytes)
+      offset = n_bytes - length;
+    offset &= ~1U;
+  }
+
+  unsigned char *sample = malloc(length);
+  if (sample == NULL) {
+    avrdude_message(MSG_INFO, "%s: xbee_confirm_page(): out of memory\n",
+                    progname);
+    return -1;
+  }
+
+  int rc = xbee_read_flash(pgm, addr + offset, sample, length);
+  if (rc == 0)
+    rc = memcmp(sample, &m->buf[addr + offset], length) == 0 ? 0 : 1;
+
+  free(sample);
+  return rc;
+}
+
+/*
+ * Is this the next part of what was written or read ahead?  Anything
+ * else, like another memory, a new buffer or a jump back to the start
+ * for the next -U operation, throws away what was done ahead.
+ */
+static int xbeeAheadTake(struct XBeeBootSession *xbs, AVRMEM *m,
+                         int written, unsigned int addr,
+                         unsigned int n_bytes)
+{
+  if (xbs->aheadMem == NULL)
+    return 0;
+
+  if (xbs->aheadMem != m || xbs->aheadBuf != m->buf ||
+      xbs->aheadWritten != written || addr != xbs->aheadStart ||
+      addr + n_bytes > xbs->aheadEnd) {
+    xbs->aheadMem = NULL;
+    return 0;
+  }
+
+  xbs->aheadStart += n_bytes;
+  if (xbs->aheadStart == xbs->aheadEnd)
+    xbs->aheadMem = NULL;
+  return 1;
+}
+
+static void xbeeAheadSet(struct XBeeBootSession *xbs, AVRMEM *m,
+                         int written, unsigned int start, unsigned int end)
+{
+  xbs->aheadMem = start < end ? m : NULL;
+  xbs->aheadBuf = m->buf;
+  xbs->aheadStart = start;
+  xbs->aheadEnd = end;
+  xbs->aheadWritten = written;
+}
+
+static int xbee_paged_write(PROGRAMMER *pgm, AVRPART *p, AVRMEM *m,
+                            unsigned int page_size,
+                            unsigned int addr, unsigned int n_bytes)
+{
+  struct XBeeBootSession *xbs = xbeebootsession(&pgm->fd);
+
+  if (xbeeAheadTake(xbs, m, 1, addr, n_bytes))
+    /* Written with an earlier page */
+    return n_bytes;
+
+  /* Anything read ahead may be about to change */
+  xbs->aheadMem = NULL;
+
+  /*
+   * Resume only applies to flash within reach of a 16-bit word
+   * address.
+   */
+  const int resume = xbs->resumeFile != NULL &&
+    strcmp(m->desc, "flash") == 0 && addr + n_bytes <= 0x20000;
+
+  unsigned int crc = 0;
+  if (resume) {
+    crc = xbeeCrc16(&m->buf[addr], n_bytes);
+
+    if (xbeeResumeFind(xbs, addr, n_bytes, crc)) {
+      const int rc = xbee_confirm_page(pgm, m, addr, n_bytes);
+      if (rc < 0)
+        return rc;
+
+      if (rc == 0) {
+        avrdude_message(MSG_NOTICE2, "%s: xbee_paged_write(): "
+                        "Page 0x%05x already written\n", progname, addr);
+        xbs->resumeSkipped++;
+        return n_bytes;
+      }
+    }
+  }
+
+  if (xbs->bootPages > 1 && !resume && strcmp(m->desc, "flash") == 0 &&
+      n_bytes == page_size && addr + n_bytes <= 0x20000) {
+    /*
+     * avrdude hands us a page at a time.  Take the pages after it
+     * that avrdude has data for too, and write them all in one
+     * command.
+     */
+    unsigned int length = n_bytes;
+    while (length < xbs->bootPages * page_size &&
+           addr + length + page_size <= (unsigned int)m->size &&
+           addr + length + page_size <= 0x20000 &&
+           xbee_page_allocated(m, addr + length, page_size))
+      length += page_size;
+
+    xbeedev_stats_command(xbs, Cmnd_STK_PROG_PAGE);
+    const int rc = xbee_write_flash(pgm, addr, &m->buf[addr], length);
+    if (rc < 0)
+      return rc;
+    xbeedev_stats_response(xbs, Cmnd_STK_PROG_PAGE);
+
+    xbeeAheadSet(xbs, m, 1, addr + n_bytes, addr + length);
+    return n_bytes;
+  }
+
+  xbeedev_stats_command(xbs, Cmnd_STK_PROG_PAGE);
+  const int rc = xbee_stk500_paged_write(pgm, p, m, page_size,
+                                         addr, n_bytes);
+  if (rc >= 0)
+    xbeedev_stats_response(xbs, Cmnd_STK_PROG_PAGE);
+
+  if (rc >= 0 && resume && xbs->resumeFile != NULL)
+    xbeeResumeCheckpoint(xbs, addr, n_bytes, crc);
+
+  return rc;
+}
+
+static int xbee_paged_load(PROGRAMMER *pgm, AVRPART *p, AVRMEM *m,
+                           unsigned int page_size,
+                           unsigned int addr, unsigned int n_bytes)
+{
+  struct XBeeBootSession *xbs = xbeebootsession(&pgm->fd);
+
+  if (xbs->bootPages == 0 || strcmp(m->desc, "flash") != 0 ||
+      addr + n_bytes > 0x20000) {
+    xbeedev_stats_command(xbs, Cmnd_STK_READ_PAGE);
+    const int rc = xbee_stk500_paged_load(pgm, p, m, page_size,
+                                          addr, n_bytes);
+    if (rc >= 0)
+      xbeedev_stats_response(xbs, Cmnd_STK_READ_PAGE);
+    return rc;
+  }
+
+  if (xbeeAheadTake(xbs, m, 0, addr, n_bytes))
+    /* Read with an earlier page */
+    return n_bytes;
+
+  unsigned int length = n_bytes;
+  if (n_bytes == page_size)
+    while (length < XBEE_READ_PAGES * page_size &&
+           addr + length + page_size <= (unsigned int)m->size &&
+           addr + length + page_size <= 0x20000)
+      length += page_size;
+
+  xbeedev_stats_command(xbs, Cmnd_STK_READ_PAGE);
+  const int rc = xbee_read_flash(pgm, addr, &m->buf[addr], length);
+  if (rc < 0)
+    return rc;
+  xbeedev_stats_response(xbs, Cmnd_STK_READ_PAGE);
+
+  xbeeAheadSet(xbs, m, 0, addr + n_bytes, addr + length);
+  return n_bytes;
+}
+
+/*
+ * Discover which XBeeBoot extensions the bootloader supports, and
+ * read back the progress journal of any interrupted update.
+ */
+static int xbee_getfeatures(PROGRAMMER *pgm)
+{
+  struct XBeeBootSession *xbs = xbeebootsession(&pgm->fd);
+  unsigned char value;
+
+  if (xbee_getparm(pgm, XBEEBOOT_PARAM_FEATURES, &value) < 0)
+    return -1;
+
+  if (!(value & XBEEBOOT_FEATURE_BASE))
+    /* Generic reply, no extensions */
+    return 0;
+
+  xbs->bootFeatures = value;
+
+  avrdude_message(MSG_NOTICE, "%s: XBeeBoot features 0x%02x\n",
+                  progname, (unsigned int)value);
+
+  if (value & XBEEBOOT_FEATURE_JOURNAL) {
+    unsigned char state, low, high;
+    if (xbee_getparm(pgm, XBEEBOOT_PARAM_JOURNAL_STATE, &state) < 0 ||
+        xbee_getparm(pgm, XBEEBOOT_PARAM_JOURNAL_LOW, &low) < 0 ||
+        xbee_getparm(pgm, XBEEBOOT_PARAM_JOURNAL_HIGH, &high) < 0)
+      return -1;
+
+    if (state == XBEEBOOT_JOURNAL_INCOMPLETE) {
+      xbs->journalPage = (long)high << 8 | low;
+      avrdude_message(MSG_INFO,
+                      "%s: XBeeBoot reports an interrupted update, "
+                      "journaled up to word address 0x%04lx\n",
+                      progname, xbs->journalPage);
+    }
+  }
+
+  if (value & XBEEBOOT_FEATURE_MULTI_PAGE) {
+    if (xbee_getparm(pgm, XBEEBOOT_PARAM_PAGES, &xbs->bootPages) < 0)
+      return -1;
+
+    avrdude_message(MSG_NOTICE, "%s: XBeeBoot takes %u pages at a time\n",
+                    progname, (unsigned int)xbs->bootPages);
+  }
+
+  return 0;
+}
+
+/*
+ * Run one LINK_TEST command, sending up bytes and asking for down
+ * bytes back.  buf needs room for whichever is larger, plus 6.
+ *
+ * Return 0 on success, or a negative value on failure.
+ */
+static int xbee_linktest_command(PROGRAMMER *pgm, unsigned char *buf,
+                                 unsigned int up, unsigned int down)
+{
+  unsigned int index;
+
+  buf[0] = XBEEBOOT_CMD_LINK_TEST;
+  buf[1] = (up >> 8) & 0xff;
+  buf[2] = up & 0xff;
+  for (index = 0; index < up; index++)
+    buf[3 + index] = index & 0xff;
+  buf[up + 3] = (down >> 8) & 0xff;
+  buf[up + 4] = down & 0xff;
+  buf[up + 5] = Sync_CRC_EOP;
+
+  if (serial_send(&pgm->fd, buf, up + 6) < 0)
+    return -1;
+
+  if (serial_recv(&pgm->fd, buf, 1) < 0)
+    return -1;
+  if (buf[0] != Resp_STK_INSYNC) {
+    avrdude_message(MSG_INFO, "%s: xbee_linktest(): protocol error, "
+                    "expect=0x%02x, resp=0x%02x\n",
+                    progname, Resp_STK_INSYNC, (unsigned int)buf[0]);
+    return -2;
+  }
+
+  if (down > 0 && serial_recv(&pgm->fd, buf, down) < 0)
+    return -1;
+  for (index = 0; index < down; index++)
+    if (buf[index] != ((down - index) & 0xff)) {
+      avrdude_message(MSG_INFO, "%s: xbee_linktest(): byte %u of %u "
+                      "corrupted\n", progname, index, down);
+      return -2;
+    }
+
+  if (serial_recv(&pgm->fd, buf, 1) < 0)
+    return -1;
+  if (buf[0] != Resp_STK_OK) {
+    avrdude_message(MSG_INFO, "%s: xbee_linktest(): protocol error, "
+                    "expect=0x%02x, resp=0x%02x\n",
+                    progname, Resp_STK_OK, (unsigned int)buf[0]);
+    return -2;
+  }
+
+  return 0;
+}
+
+static double xbeeElapsed(uint64_t start)
+{
+  return (xbeeClock() - start) / 1e9;
+}
+
+/*
+ * Time the link to the bootloader, without touching flash: the round
+ * trip of empty commands, then bytes bytes sent up the link, then
+ * bytes bytes back down it.  Each is reported with the statistics
+ * group timing its frames, measured for the test alone.
+ *
+ * Return 0 on success, or a negative value on failure.
+ */
+static int xbee_linktest(PROGRAMMER *pgm, unsigned int bytes)
+{
+  struct XBeeBootSession *xbs = xbeebootsession(&pgm->fd);
+
+  if (!(xbs->bootFeatures & XBEEBOOT_FEATURE_LINK_TEST)) {
+    avrdude_message(MSG_INFO, "%s: XBeeBoot was not built with LINK_TEST, "
+                    "can't run xbeelinktest\n", progname);
+    return -1;
+  }
+
+  unsigned char *buf = malloc(bytes + 6);
+  if (buf == NULL) {
+    avrdude_message(MSG_INFO, "%s: xbee_linktest(): out of memory\n",
+                    progname);
+    return -1;
+  }
+
+  /* The session's own statistics are put back afterwards */
+  struct XBeeStaticticsSummary session[XBEE_STATS_GROUPS];
+  memcpy(session, xbs->groupSummary, sizeof(session));
+
+  struct XBeeStaticticsSummary roundTrip;
+  uint64_t start;
+  double seconds;
+  int rc = 0;
+  int trip;
+
+  xbeeStatsReset(&roundTrip);
+  start = xbeeClock();
+  for (trip = 0; rc == 0 && trip < XBEE_LINK_TEST_ROUND_TRIPS; trip++) {
+    const uint64_t sent = xbeeClock();
+    rc = xbee_linktest_command(pgm, buf, 0, 0);
+    xbeeStatsAdd(&roundTrip, xbeeClock() - sent);
+  }
+  if (rc == 0) {
+    seconds = xbeeElapsed(start);
+    avrdude_message(MSG_INFO, "%s: Link test: %d round trips, "
+                    "%.1f ms each\n", progname, XBEE_LINK_TEST_ROUND_TRIPS,
+                    seconds * 1000 / XBEE_LINK_TEST_ROUND_TRIPS);
+    avrdude_message(MSG_NOTICE, "%s: Statistics for round trips - "
+                    "%s->XBeeBoot->%s\n", progname, progname, progname);
+    xbeeStatsSummarise(&roundTrip);
+  }
+
+  if (rc == 0) {
+    xbeeStatsReset(&xbs->groupSummary[XBEE_STATS_TRANSMIT]);
+    start = xbeeClock();
+    rc = xbee_linktest_command(pgm, buf, bytes, 0);
+  }
+  if (rc == 0) {
+    seconds = xbeeElapsed(start);
+    avrdude_message(MSG_INFO, "%s: Link test: uplink %u bytes in %.2f s, "
+                    "%.1f bytes/s\n", progname, bytes, seconds,
+                    bytes / seconds);
+    avrdude_message(MSG_NOTICE, "%s: Statistics for TRANSMIT requests - "
+                    "%s->XBee(local)->XBee(target)->XBeeBoot\n",
+                    progname, progname);
+    xbeeStatsSummarise(&xbs->groupSummary[XBEE_STATS_TRANSMIT]);
+  }
+
+  if (rc == 0) {
+    xbeeStatsReset(&xbs->groupSummary[XBEE_STATS_RECEIVE]);
+    start = xbeeClock();
+    rc = xbee_linktest_command(pgm, buf, 0, bytes);
+  }
+  if (rc == 0) {
+    seconds = xbeeElapsed(start);
+    avrdude_message(MSG_INFO, "%s: Link test: downlink %u bytes in %.2f s, "
+                    "%.1f bytes/s\n", progname, bytes, seconds,
+                    bytes / seconds);
+    avrdude_message(MSG_NOTICE, "%s: Statistics for RECEIVE requests - "
+                    "XBeeBoot->XBee(target)->XBee(local)->%s\n",
+                    progname, progname);
+    xbeeStatsSummarise(&xbs->groupSummary[XBEE_STATS_RECEIVE]);
+  }
+
+  memcpy(xbs->groupSummary, session, sizeof(session));
+  free(buf);
+  return rc;
+}
+
+/*
+ * Give up on xbee_open() once the session exists.  avrdude doesn't
+ * close a programmer that failed to open, so close the session here,
+ * finishing any trace or capture file.
+ */
+static int xbee_open_failed(PROGRAMMER *pgm)
+{
+  serial_close(&pgm->fd);
+  return -1;
+}
+
 static int xbee_open(PROGRAMMER *pgm, char *port)
 {
   union pinfo pinfo;
@@ -1659,36 +3530,123 @@ static int xbee_open(PROGRAMMER *pgm, char *port)
    */
   xbeedev_setresetpin(&pgm->fd, pgm->flag);
 
-  /* Clear DTR and RTS */
-  serial_set_dtr_rts(&pgm->fd, 0);
-  usleep(250*1000);
+  struct XBeeBootSession *xbs = xbeebootsession(&pgm->fd);
 
-  /* Set DTR and RTS back to high */
-  serial_set_dtr_rts(&pgm->fd, 1);
-  usleep(50*1000);
+  if (xbeeExtParams.traceFile != NULL &&
+      xbeeTraceOpen(xbs, xbeeExtParams.traceFile) < 0)
+    return xbee_open_failed(pgm);
 
-  /*
-   * At this point stk500_drain() and stk500_getsync() calls would
-   * normally be made.  But given that we have a transport layer over
-   * the serial command stream, the drain and repeated STK_GET_SYNC
-   * requests are not very helpful.  Instead, skip the draining
-   * entirely, and issue the STK_GET_SYNC ourselves.
-   */
-  if (xbee_getsync(pgm) < 0)
-    return -1;
+  if (xbeeExtParams.noAckTimeout > 0 && !xbs->directMode) {
+    /*
+     * XBeeBoot already acknowledges and retransmits every packet, so
+     * the APS acknowledgements only add airtime.
+     */
+    xbs->transmitOptions = XBEE_TX_DISABLE_ACK;
+    xbs->retransmitTimeout = xbeeExtParams.noAckTimeout;
+    xbs->retransmitLimit =
+      XBEE_MAX_RETRIES * serial_recv_timeout / xbeeExtParams.noAckTimeout;
+    if (xbs->retransmitLimit < XBEE_MAX_RETRIES)
+      xbs->retransmitLimit = XBEE_MAX_RETRIES;
+
+    avrdude_message(MSG_NOTICE, "%s: APS acknowledgements disabled, "
+                    "retransmitting after %ld ms up to %d times\n",
+                    progname, xbs->retransmitTimeout, xbs->retransmitLimit);
+  }
+
+  if (xbeeExtParams.appEntry) {
+    /*
+     * A running application using the XBeeBootEntry library
+     * recognises our STK_GET_SYNC, and hands it over to the
+     * bootloader without needing a reset.
+     */
+    if (xbee_getsync(pgm) == 0) {
+      xbs->appEntry = 1;
+    } else {
+      avrdude_message(MSG_INFO, "%s: Application did not enter the "
+                      "bootloader, resetting instead\n", progname);
+      xbeedev_restart(&pgm->fd);
+    }
+  }
+
+  if (!xbs->appEntry) {
+    /* Clear DTR and RTS */
+    serial_set_dtr_rts(&pgm->fd, 0);
+    usleep(250*1000);
+
+    /* Set DTR and RTS back to high */
+    serial_set_dtr_rts(&pgm->fd, 1);
+    usleep(50*1000);
+
+    /*
+     * At this point stk500_drain() and stk500_getsync() calls would
+     * normally be made.  But given that we have a transport layer
+     * over the serial command stream, the drain and repeated
+     * STK_GET_SYNC requests are not very helpful.  Instead, skip the
+     * draining entirely, and issue the STK_GET_SYNC ourselves.
+     */
+    if (xbee_getsync(pgm) < 0)
+      return xbee_open_failed(pgm);
+  }
+
+  if (xbee_getfeatures(pgm) < 0)
+    return xbee_open_failed(pgm);
+
+  if (xbeeExtParams.resume &&
+      xbeeResumeLoad(xbs, xbeeExtParams.resumeFile) < 0)
+    return xbee_open_failed(pgm);
+
+  if (xbeeExtParams.linkTest > 0 &&
+      xbee_linktest(pgm, xbeeExtParams.linkTest) < 0)
+    return xbee_open_failed(pgm);
 
   return 0;
 }
 
+/*
+ * STK_LEAVE_PROGMODE starts the application, so read the bootloader's
+ * counters first, for xbee_close() to report.
+ */
+static void xbee_disable(PROGRAMMER *pgm)
+{
+  struct XBeeBootSession *xbs = xbeebootsession(&pgm->fd);
+
+  xbs->aheadMem = NULL;
+
+  if ((xbs->bootFeatures & XBEEBOOT_FEATURE_COUNTERS) &&
+      !xbs->transportUnusable) {
+    int counter;
+    for (counter = 0; counter < XBEEBOOT_COUNTERS; counter++)
+      if (xbee_getparm(pgm, XBEEBOOT_PARAM_COUNTERS + counter,
+                       &xbs->bootCounters[counter]) < 0)
+        break;
+    xbs->bootCountersRead = counter == XBEEBOOT_COUNTERS;
+  }
+
+  xbee_stk500_disable(pgm);
+}
+
+/*
+ * Flash read ahead is stale once it is erased.
+ */
+static int xbee_chip_erase(PROGRAMMER *pgm, AVRPART *p)
+{
+  struct XBeeBootSession *xbs = xbeebootsession(&pgm->fd);
+
+  xbs->aheadMem = NULL;
+  return xbee_stk500_chip_erase(pgm, p);
+}
+
 static void xbee_close(PROGRAMMER *pgm)
 {
   struct XBeeBootSession *xbs = xbeebootsession(&pgm->fd);
 
   /*
    * NB: This request is for the target device, not the locally
-   * connected serial device.
+   * connected serial device.  It isn't needed if the reset pin was
+   * never used.
    */
-  serial_set_dtr_rts(&pgm->fd, 0);
+  if (!xbs->appEntry)
+    serial_set_dtr_rts(&pgm->fd, 0);
 
   /*
    * We have tweaked a few settings on the XBee, including the RTS
@@ -1704,6 +3662,37 @@ static void xbee_close(PROGRAMMER *pgm)
     xbeeATError(rc);
   }
 
+  if (xbs->resumeFile != NULL) {
+    if (xbs->resumeSkipped > 0)
+      avrdude_message(MSG_INFO, "%s: Resumed update, %u pages were already "
+                      "written\n", progname, xbs->resumeSkipped);
+
+    /*
+     * Only a broken transport leaves an update to be resumed.
+     * Otherwise the session is over, successful or not.
+     */
+    if (!xbs->transportUnusable) {
+      if (xbs->resumeLog != NULL) {
+        fclose(xbs->resumeLog);
+        xbs->resumeLog = NULL;
+      }
+      remove(xbs->resumeFile);
+    }
+  }
+
+  avrdude_message(MSG_NOTICE, "%s: Sent %lu XBee API frames, %lu of them "
+                  "retries\n", progname, xbs->framesSent, xbs->framesRetried);
+
+  if (xbs->bootCountersRead)
+    avrdude_message(MSG_INFO, "%s: XBeeBoot saw %u bad checksums, %u frames "
+                    "out of sequence and %u it was too busy for, and resent "
+                    "%u replies\n", progname,
+                    (unsigned int)xbs->bootCounters[XBEEBOOT_COUNTER_CHECKSUM],
+                    (unsigned int)xbs->bootCounters[XBEEBOOT_COUNTER_SEQUENCE],
+                    (unsigned int)xbs->bootCounters[XBEEBOOT_COUNTER_BUSY],
+                    (unsigned int)
+                    xbs->bootCounters[XBEEBOOT_COUNTER_RETRANSMIT]);
+
   avrdude_message(MSG_NOTICE, "%s: Statistics for FRAME_LOCAL requests - %s->XBee(local)\n", progname, progname);
   xbeeStatsSummarise(&xbs->groupSummary[XBEE_STATS_FRAME_LOCAL]);
 
@@ -1716,6 +3705,18 @@ static void xbee_close(PROGRAMMER *pgm)
   avrdude_message(MSG_NOTICE, "%s: Statistics for RECEIVE requests - XBeeBoot->XBee(target)->XBee(local)->%s\n", progname, progname);
   xbeeStatsSummarise(&xbs->groupSummary[XBEE_STATS_RECEIVE]);
 
+  avrdude_message(MSG_NOTICE, "%s: Statistics for COMMAND requests - %s->XBeeBoot(command)->%s\n", progname, progname, progname);
+  xbeeStatsSummarise(&xbs->groupSummary[XBEE_STATS_COMMAND]);
+
+  int opcode;
+  for (opcode = 0; opcode < 256; opcode++)
+    if (xbs->commandSummary[opcode].samples > 0) {
+      avrdude_message(MSG_NOTICE, "%s:  STK500 command 0x%02x, "
+                      "%lu times\n", progname, (unsigned int)opcode,
+                      xbs->commandSummary[opcode].samples);
+      xbeeStatsSummarise(&xbs->commandSummary[opcode]);
+    }
+
   xbeedev_free(xbs);
 
   pgm->fd.pfd = NULL;
@@ -1746,6 +3747,103 @@ static int xbee_parseextparms(PROGRAMMER *pgm, LISTID extparms)
       continue;
     }
 
+    if (strcmp(extended_param, "xbeeappentry") == 0) {
+      xbeeExtParams.appEntry = 1;
+      continue;
+    }
+
+    if (strcmp(extended_param, "xbeenoack") == 0) {
+      xbeeExtParams.noAckTimeout = XBEE_NOACK_TIMEOUT;
+      continue;
+    }
+
+    if (strncmp(extended_param,
+                "xbeenoack=", 10 /*strlen("xbeenoack=")*/) == 0) {
+      long timeout;
+      if (sscanf(extended_param, "xbeenoack=%li", &timeout) != 1 ||
+          timeout <= 0 || timeout > 1000) {
+        avrdude_message(MSG_INFO, "%s: xbee_parseextparms(): "
+                        "invalid xbeenoack '%s'\n",
+                        progname, extended_param);
+        rc = -1;
+        continue;
+      }
+
+      xbeeExtParams.noAckTimeout = timeout;
+      continue;
+    }
+
+    if (strcmp(extended_param, "xbeelinktest") == 0) {
+      xbeeExtParams.linkTest = XBEE_LINK_TEST_BYTES;
+      continue;
+    }
+
+    if (strncmp(extended_param,
+                "xbeelinktest=", 13 /*strlen("xbeelinktest=")*/) == 0) {
+      long bytes;
+      if (sscanf(extended_param, "xbeelinktest=%li", &bytes) != 1 ||
+          bytes <= 0 || bytes > 65535) {
+        avrdude_message(MSG_INFO, "%s: xbee_parseextparms(): "
+                        "invalid xbeelinktest '%s'\n",
+                        progname, extended_param);
+        rc = -1;
+        continue;
+      }
+
+      xbeeExtParams.linkTest = bytes;
+      continue;
+    }
+
+    if (strncmp(extended_param,
+                "xbeetrace=", 10 /*strlen("xbeetrace=")*/) == 0) {
+      free(xbeeExtParams.traceFile);
+      xbeeExtParams.traceFile = strdup(&extended_param[10]);
+      continue;
+    }
+
+    if (strncmp(extended_param,
+                "xbeecapture=", 12 /*strlen("xbeecapture=")*/) == 0) {
+      free(xbeeExtParams.captureFile);
+      xbeeExtParams.captureFile = strdup(&extended_param[12]);
+      continue;
+    }
+
+    if (strncmp(extended_param,
+                "xbeereplay=", 11 /*strlen("xbeereplay=")*/) == 0) {
+      free(xbeeExtParams.replayFile);
+      xbeeExtParams.replayFile = strdup(&extended_param[11]);
+      continue;
+    }
+
+    if (strncmp(extended_param,
+                "xbeereplayspeed=", 16 /*strlen("xbeereplayspeed=")*/) == 0) {
+      double speed;
+      if (sscanf(extended_param, "xbeereplayspeed=%lf", &speed) != 1 ||
+          speed < 0) {
+        avrdude_message(MSG_INFO, "%s: xbee_parseextparms(): "
+                        "invalid xbeereplayspeed '%s'\n",
+                        progname, extended_param);
+        rc = -1;
+        continue;
+      }
+
+      xbeeExtParams.replaySpeed = speed;
+      continue;
+    }
+
+    if (strcmp(extended_param, "xbeeresume") == 0) {
+      xbeeExtParams.resume = 1;
+      continue;
+    }
+
+    if (strncmp(extended_param,
+                "xbeeresume=", 11 /*strlen("xbeeresume=")*/) == 0) {
+      free(xbeeExtParams.resumeFile);
+      xbeeExtParams.resumeFile = strdup(&extended_param[11]);
+      xbeeExtParams.resume = 1;
+      continue;
+    }
+
     avrdude_message(MSG_INFO, "%s: xbee_parseextparms(): "
                     "invalid extended parameter '%s'\n",
                     progname, extended_param);
@@ -1780,4 +3878,22 @@ void xbee_initpgm(PROGRAMMER *pgm)
    */
   pgm->parseextparams = xbee_parseextparms;
   pgm->flag = XBEE_DEFAULT_RESET_PIN;
+
+  /*
+   * Page writes are intercepted to checkpoint, and when resuming skip,
+   * pages acknowledged by the bootloader.  Both page writes and reads
+   * are batched for a MULTI_PAGE bootloader.
+   */
+  xbee_stk500_paged_write = pgm->paged_write;
+  pgm->paged_write = xbee_paged_write;
+  xbee_stk500_paged_load = pgm->paged_load;
+  pgm->paged_load = xbee_paged_load;
+
+  /* The bootloader's counters are read before it leaves */
+  xbee_stk500_disable = pgm->disable;
+  pgm->disable = xbee_disable;
+
+  /* Erasing throws away flash read ahead */
+  xbee_stk500_chip_erase = pgm->chip_erase;
+  pgm->chip_erase = xbee_chip_erase;
 }
@@ -0,0 +1,359 @@
+/*
+ * avrdude - A Downloader/Uploader for AVR device programmers
+ * Copyright (C) 2015-2020 David Sainty
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Host frame encode/decode microbenchmark for the xbee programmer.
+ *
+ * Feeds synthetic XBeeBoot traffic through the real frame encoder
+ * (sendPacket() and sendAPIRequest()) and decoder (xbeedev_poll())
+ * with the serial port replaced by memory, and reports throughput in
+ * MB/s and the cost per frame.  Payloads are generated with a fixed
+ * density of bytes needing API mode 2 escapes.
+ *
+ * Build from a configured avrdude source tree with xbee.c in place:
+ *
+ *   make -f Makefile.xbee_bench AVRDUDE_SRC=/path/to/avrdude
+ *   ./xbee_bench
+ */
+
+#include "xbee.c"
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Just enough of avrdude to host xbee.c.
+ */
+
+char *progname = "xbee_bench";
+int verbose = -1;
+long serial_recv_timeout = 5000;
+struct serial_device serial_serdev;
+struct serial_device *serdev = &serial_serdev;
+
+int avrdude_message(const int msglvl, const char *format, ...)
+{
+  if (verbose < msglvl)
+    return 0;
+
+  va_list ap;
+  va_start(ap, format);
+  const int rc = vfprintf(stderr, format, ap);
+  va_end(ap);
+  return rc;
+}
+
+void stk500_initpgm(PROGRAMMER *pgm)
+{
+  (void)pgm;
+}
+
+LNODEID lfirst(LISTID list)
+{
+  (void)list;
+  return NULL;
+}
+
+LNODEID lnext(LNODEID node)
+{
+  (void)node;
+  return NULL;
+}
+
+void *ldata(LNODEID node)
+{
+  (void)node;
+  return NULL;
+}
+
+/*
+ * The serial port, in memory.
+ */
+
+static unsigned long long benchSent;
+
+static const unsigned char *benchStream;
+static size_t benchStreamLength;
+static size_t benchStreamIndex;
+
+static int benchSend(union filedescriptor *fd, const unsigned char *buf,
+                     size_t buflen)
+{
+  (void)fd;
+  (void)buf;
+
+  benchSent += buflen;
+  return 0;
+}
+
+static int benchRecv(union filedescriptor *fd, unsigned char *buf,
+                     size_t buflen)
+{
+  (void)fd;
+
+  while (buflen-- > 0) {
+    *buf++ = benchStream[benchStreamIndex++];
+    if (benchStreamIndex == benchStreamLength)
+      benchStreamIndex = 0;
+  }
+  return 0;
+}
+
+static struct serial_device benchDevice = {
+  .send = benchSend,
+  .recv = benchRecv,
+};
+
+static const unsigned char benchAddress[10] = {
+  0x00, 0x13, 0xa2, 0x00, 0x41, 0x7e, 0x11, 0x13, 0xff, 0xfe
+};
+
+static uint64_t benchRandomState = 0x2545f4914f6cdd1dULL;
+
+static unsigned int benchRandom(void)
+{
+  benchRandomState ^= benchRandomState >> 12;
+  benchRandomState ^= benchRandomState << 25;
+  benchRandomState ^= benchRandomState >> 27;
+  return (benchRandomState * 0x2545f4914f6cdd1dULL) >> 32;
+}
+
+/*
+ * Fill a payload where roughly the given fraction of bytes need
+ * escaping.  A density of -1 gives uniformly random bytes.
+ */
+static void benchPayload(unsigned char *data, size_t length, double density)
+{
+  static const unsigned char escapes[] = { 0x7d, 0x7e, 0x11, 0x13 };
+  size_t index;
+
+  for (index = 0; index < length; index++) {
+    unsigned char byte = benchRandom();
+    if (density >= 0) {
+      if (benchRandom() < density * 4294967296.0)
+        byte = escapes[benchRandom() % 4];
+      else
+        while (byte == 0x7d || byte == 0x7e || byte == 0x11 || byte == 0x13)
+          byte = benchRandom();
+    }
+    data[index] = byte;
+  }
+}
+
+static double benchNow(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static struct XBeeBootSession *benchSession(void)
+{
+  struct XBeeBootSession *xbs = malloc(sizeof(struct XBeeBootSession));
+  if (xbs == NULL) {
+    perror(progname);
+    exit(1);
+  }
+
+  XBeeBootSessionInit(xbs);
+  xbs->serialDevice = &benchDevice;
+  xbs->directMode = 0;
+  memcpy(xbs->xbee_address, benchAddress, sizeof(benchAddress));
+
+  return xbs;
+}
+
+static void benchReport(char const *name, char const *label,
+                        unsigned long frames, size_t payload,
+                        unsigned long long wire, double seconds)
+{
+  printf("%-7s %-8s %9.1f MB/s payload %9.1f MB/s wire %8.1f ns/frame\n",
+         name, label,
+         frames * (double)payload / seconds / 1e6,
+         wire / seconds / 1e6,
+         seconds * 1e9 / frames);
+}
+
+/*
+ * Encode Transmit Requests carrying XBeeBoot data packets, as
+ * xbeedev_send() does for every chunk of a page.
+ */
+static void benchEncode(char const *label, double density,
+                        unsigned long frames, size_t payload)
+{
+  struct XBeeBootSession *xbs = benchSession();
+  unsigned char data[256][XBEEBOOT_MAX_CHUNK];
+  unsigned long frame;
+
+  for (frame = 0; frame < 256; frame++)
+    benchPayload(data[frame], payload, density);
+
+  benchSent = 0;
+  const double start = benchNow();
+
+  for (frame = 0; frame < frames; frame++) {
+    unsigned char sequence = frame % 255 + 1;
+    sendPacket(xbs, "Benchmark", XBEEBOOT_PACKET_TYPE_REQUEST, sequence,
+               XBEE_STATS_NOT_RETRY, 23 /* FIRMWARE_DELIVER */,
+               payload, data[frame & 0xff]);
+  }
+
+  benchReport("encode", label, frames, payload, benchSent,
+              benchNow() - start);
+  free(xbs);
+}
+
+/*
+ * Append an escaped API frame to a stream.
+ */
+static size_t benchFrame(unsigned char *out, const unsigned char *frame,
+                         size_t length)
+{
+  unsigned char *const start = out;
+  unsigned char checksum = 0xff;
+  size_t index;
+
+#define BENCH_PUT(x)                                            \
+  do {                                                          \
+    const unsigned char v = (x);                                \
+    if (v == 0x7d || v == 0x7e || v == 0x11 || v == 0x13) {     \
+      *out++ = 0x7d;                                            \
+      *out++ = v ^ 0x20;                                        \
+    } else {                                                    \
+      *out++ = v;                                               \
+    }                                                           \
+  } while (0)
+
+  *out++ = 0x7e;
+  BENCH_PUT(length >> 8);
+  BENCH_PUT(length & 0xff);
+  for (index = 0; index < length; index++) {
+    BENCH_PUT(frame[index]);
+    checksum -= frame[index];
+  }
+  BENCH_PUT(checksum);
+
+  return out - start;
+}
+
+/*
+ * Decode Receive Packets carrying XBeeBoot replies, as xbeedev_recv()
+ * does while reading back a page.  Each one is ACKed, so this includes
+ * encoding the ACK.
+ */
+static void benchDecode(char const *label, double density,
+                        unsigned long frames, size_t payload)
+{
+  struct XBeeBootSession *xbs = benchSession();
+
+  /* One full cycle of sequence numbers */
+  static unsigned char stream[255 * (2 * 256 + 8)];
+  size_t streamLength = 0;
+  unsigned long long wirePerCycle;
+  int sequence;
+
+  for (sequence = 1; sequence <= 255; sequence++) {
+    unsigned char frame[256];
+    size_t length = 0;
+    frame[length++] = 0x90; /* ZigBee Receive Packet */
+    memcpy(&frame[length], benchAddress, sizeof(benchAddress));
+    length += sizeof(benchAddress);
+    frame[length++] = 0x01; /* Packet acknowledged */
+    frame[length++] = XBEEBOOT_PACKET_TYPE_REQUEST;
+    frame[length++] = sequence;
+    frame[length++] = 24; /* FIRMWARE_REPLY */
+    benchPayload(&frame[length], payload, density);
+    length += payload;
+
+    streamLength += benchFrame(&stream[streamLength], frame, length);
+  }
+  wirePerCycle = streamLength;
+
+  benchStream = stream;
+  benchStreamLength = streamLength;
+  benchStreamIndex = 0;
+
+  unsigned char buffer[256];
+  unsigned long frame;
+  const double start = benchNow();
+
+  for (frame = 0; frame < frames; frame++) {
+    unsigned char *buf = buffer;
+    size_t buflen = payload;
+    if (xbeedev_poll(xbs, &buf, &buflen, -1, -1) != 0) {
+      fprintf(stderr, "%s: decode failed\n", progname);
+      exit(1);
+    }
+  }
+
+  benchReport("decode", label, frames, payload,
+              wirePerCycle * frames / 255, benchNow() - start);
+  free(xbs);
+}
+
+int main(int argc, char **argv)
+{
+  static const struct {
+    char const *label;
+    double density;
+  } mixes[] = {
+    { "none", 0 },
+    { "random", -1 }, /* 4 in 256 */
+    { "10%", 0.10 },
+    { "all", 1 },
+  };
+
+  unsigned long frames = 1000000;
+  size_t payload = XBEEBOOT_MAX_CHUNK;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:s:v")) != -1) {
+    switch (opt) {
+    case 'n':
+      frames = strtoul(optarg, NULL, 0);
+      break;
+    case 's':
+      payload = strtoul(optarg, NULL, 0);
+      break;
+    case 'v':
+      verbose++;
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-n frames] [-s payload] [-v]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  if (frames == 0 || payload < 1 || payload > XBEEBOOT_MAX_CHUNK) {
+    fprintf(stderr, "%s: payload must be 1 to %d bytes\n", progname,
+            XBEEBOOT_MAX_CHUNK);
+    return 2;
+  }
+
+  printf("%lu frames of %u payload bytes per run, escape density:\n",
+         frames, (unsigned int)payload);
+
+  size_t mix;
+  for (mix = 0; mix < sizeof(mixes) / sizeof(mixes[0]); mix++)
+    benchEncode(mixes[mix].label, mixes[mix].density, frames, payload);
+  for (mix = 0; mix < sizeof(mixes) / sizeof(mixes[0]); mix++)
+    benchDecode(mixes[mix].label, mixes[mix].density, frames, payload);
+
+  return 0;
+}
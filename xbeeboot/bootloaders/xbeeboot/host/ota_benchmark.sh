@@ -0,0 +1,211 @@
+#!/bin/sh
+#
+# Standard Over-The-Air throughput benchmark.
+#
+# Programs each of the chaucer example sketches through the avrdude
+# xbee programmer into xbeeboot_host_atmega1284p, under a fixed set of
+# link profiles:
+#
+#   direct  The programmer attached straight to the bootloader's UART
+#   1hop    Through xbeemesh, one intermediate hop
+#   3hop    Through xbeemesh, three intermediate hops
+#   loss5   Through xbeemesh, a single link losing 5% of frames
+#
+# Every run appends a line to the results file, recording the image
+# size, the wall time of the avrdude run (write and verify), bytes per
+# second, and the API frames the programmer sent and retried.  The mesh
+# is seeded, so runs of the same versions are comparable and the
+# results file can be diffed between versions.
+#
+# Run from the bootloader directory after "make host", eg
+#   make benchmark
+#   sh host/ota_benchmark.sh -w "16k 32k" -p "direct 3hop" -o results.txt
+#
+# -x passes extended parameters to the xbee programmer, and appends them
+# to the profile names in the results, eg to compare against the
+# current mode
+#   sh host/ota_benchmark.sh -p "1hop 3hop loss5" -x xbeenoack
+#
+# The sketches are built with arduino-cli for the XBeeBoot Mega1284
+# board, unless -i names a directory already holding chaucer<size>.hex.
+#
+# Environment: AVRDUDE, AVRDUDE_CONF, ARDUINO_CLI, FQBN and BAUD.
+#
+# * Copyright (C) 2015-2020 David Sainty
+# * This software is licensed under version 2 of the Gnu Public Licence.
+
+AVRDUDE=${AVRDUDE:-avrdude}
+ARDUINO_CLI=${ARDUINO_CLI:-arduino-cli}
+FQBN=${FQBN:-XBeeBoot:avr:xbeeboot1284}
+BAUD=${BAUD:-115200}
+
+EXAMPLES=../../examples
+HOST=./xbeeboot_host_atmega1284p
+MESH=./xbeemesh
+TARGET=0013a20000000001
+
+results=benchmark.txt
+images=
+workloads="16k 32k 64k 112k"
+profiles="direct 1hop 3hop loss5"
+extparams=
+
+usage() {
+  echo "Usage: $0 [-o results] [-i imagedir] [-w workloads] [-p profiles]" \
+       "[-x extparams]" >&2
+  exit 2
+}
+
+while getopts "o:i:w:p:x:" opt; do
+  case $opt in
+    o) results=$OPTARG ;;
+    i) images=$OPTARG ;;
+    w) workloads=$OPTARG ;;
+    p) profiles=$OPTARG ;;
+    x) extparams="$extparams $OPTARG" ;;
+    *) usage ;;
+  esac
+done
+
+xflags=
+suffix=
+for extparam in $extparams; do
+  xflags="$xflags -x $extparam"
+  suffix="$suffix+$extparam"
+done
+
+for tool in $HOST $MESH; do
+  if [ ! -x $tool ]; then
+    echo "$0: $tool is missing, run \"make host\" first" >&2
+    exit 1
+  fi
+done
+
+work=$(mktemp -d /tmp/xbeeboot_benchmark.XXXXXX) || exit 1
+pids=
+cleanup() {
+  [ -n "$pids" ] && kill $pids 2>/dev/null
+  wait 2>/dev/null
+  pids=
+}
+trap 'cleanup; rm -rf $work' EXIT
+trap 'exit 1' INT TERM
+
+# Wait for a simulator to announce its ptys
+waitfor() {
+  tries=0
+  while ! grep -q "$2" $1 2>/dev/null; do
+    tries=$((tries + 1))
+    if [ $tries -gt 50 ]; then
+      echo "$0: $1 never started" >&2
+      return 1
+    fi
+    sleep 0.1
+  done
+}
+
+# Build a chaucer sketch, fixed up for current Arduino cores
+image() {
+  if [ -n "$images" ]; then
+    echo $images/chaucer$1.hex
+    return
+  fi
+
+  sketch=$work/chaucer$1
+  mkdir -p $sketch
+  sed -e 's/^prog_char /const char /' \
+      -e 's/Serial\.print(c, *BYTE)/Serial.write(c)/' \
+      $EXAMPLES/chaucer$1/chaucer$1.pde > $sketch/chaucer$1.ino
+  $ARDUINO_CLI compile --fqbn $FQBN --output-dir $sketch/build $sketch \
+    > $sketch/build.log 2>&1 || {
+    echo "$0: building chaucer$1 failed, see below" >&2
+    cat $sketch/build.log >&2
+    return 1
+  }
+  echo $sketch/build/chaucer$1.ino.hex
+}
+
+# Bytes of data in an Intel hex file
+hexbytes() {
+  awk '/^:/ && substr($0, 8, 2) == "00" { n += ("0x" substr($0, 2, 2)) + 0 }
+       END { print n }' $1
+}
+
+# Start the stand-in for a profile, and set port to program it through
+standin() {
+  rm -f $work/flash.bin $work/host.txt $work/mesh.txt
+
+  case $1 in
+    direct)
+      $HOST -b $BAUD -f $work/flash.bin > $work/host.txt 2>&1 &
+      pids="$pids $!"
+      waitfor $work/host.txt "simulator on" || return 1
+      port=@$(awk '/simulator on/ { print $4 }' $work/host.txt)
+      return 0
+      ;;
+    1hop) mesh="-t $TARGET:1" ;;
+    3hop) mesh="-t $TARGET:3" ;;
+    loss5) mesh="-L 0.05 -t $TARGET:0" ;;
+    *)
+      echo "$0: unknown profile $1" >&2
+      return 1
+      ;;
+  esac
+
+  $MESH -s 1 $mesh > $work/mesh.txt 2>&1 &
+  pids="$pids $!"
+  waitfor $work/mesh.txt "^target" || return 1
+
+  $HOST -r -b $BAUD -f $work/flash.bin \
+    -p $(awk '/^target/ { print $4 }' $work/mesh.txt) > $work/host.txt 2>&1 &
+  pids="$pids $!"
+
+  port=$TARGET@$(awk '/^coordinator/ { print $4 }' $work/mesh.txt)
+}
+
+now() {
+  date +%s.%N
+}
+
+if [ ! -f $results ]; then
+  {
+    echo "# XBeeBoot OTA benchmark: ATmega1284P stand-in at $BAUD baud"
+    echo "# workload profile bytes seconds bytes/s frames retries"
+  } > $results
+fi
+
+for workload in $workloads; do
+  hex=$(image $workload) || exit 1
+  bytes=$(hexbytes $hex)
+
+  for profile in $profiles; do
+    standin $profile || exit 1
+
+    start=$(now)
+    $AVRDUDE ${AVRDUDE_CONF:+-C $AVRDUDE_CONF} -v -c xbee -p m1284p $xflags \
+      -P $port -b $BAUD -D -U flash:w:$hex:i > $work/avrdude.log 2>&1
+    rc=$?
+    end=$(now)
+
+    cleanup
+
+    if [ $rc -ne 0 ]; then
+      printf "chaucer%-5s %-7s %7d FAILED\n" $workload $profile$suffix \
+        $bytes >> $results
+      echo "$0: chaucer$workload over $profile failed:" >&2
+      tail -5 $work/avrdude.log >&2
+      continue
+    fi
+
+    frames=$(sed -n 's/.*Sent \([0-9]*\) XBee API frames.*/\1/p' \
+      $work/avrdude.log)
+    retries=$(sed -n 's/.*XBee API frames, \([0-9]*\) of them retries.*/\1/p' \
+      $work/avrdude.log)
+
+    awk -v w=chaucer$workload -v p=$profile$suffix -v b=$bytes \
+        -v s=$start -v e=$end -v f=${frames:-0} -v r=${retries:-0} \
+        'BEGIN { t = e - s;
+                 printf "%-12s %-7s %7d %8.2f %8.1f %7d %7d\n",
+                        w, p, b, t, b / t, f, r }' | tee -a $results
+  done
+done
@@ -0,0 +1,632 @@
+/*
+ * Host-native XBeeBoot simulator.
+ *
+ * Runs xbeeboot.c, built with XBEEBOOT_HOST, as an ordinary process
+ * against a simulated ATmega328P (xbeeboot_host) or ATmega1284P
+ * (xbeeboot_host_atmega1284p).  The simulated UART is a pseudo
+ * terminal, so the avrdude xbee programmer can program it in direct
+ * mode:
+ *
+ *   ./xbeeboot_host
+ *   XBeeBoot simulator on /dev/pts/5
+ *
+ *   avrdude -c xbee -p m328p -P @/dev/pts/5 -b 9600 -U flash:w:image.hex
+ *
+ * The simulated application does nothing but wait for serial input,
+ * which it treats as the programmer resetting the AVR.  With -r, the
+ * AVR is instead reset by a raw XOFF (0x13), which xbeemesh sends when
+ * the target XBee releases the reset line; see xbeemesh.c.  The watchdog
+ * is a real-time interval timer, and resets the AVR by jumping back
+ * to the start of the bootloader.  RAM survives resets, as it does on
+ * the AVR.
+ *
+ * Copyright (C) 2015-2020 David Sainty
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "xbeeboot_host.h"
+
+/* We are the real main(), xbeeboot.c provides xbeebootMain() */
+#undef main
+int xbeebootMain(void);
+
+#ifndef BAUD_RATE
+#define BAUD_RATE 9600L
+#endif
+
+/* Worst case tWD_FLASH for page erase and page write */
+#define HOST_SPM_US 4500
+/* Worst case tWD_EEPROM for an EEPROM byte write */
+#define HOST_EEPROM_US 3400
+
+uint8_t hostRam[RAMSIZE];
+uint8_t hostFlash[FLASHEND + 1];
+uint8_t hostEeprom[E2END + 1];
+uint8_t hostMcusr;
+uint8_t hostUartRegister;
+uint8_t hostTimerRegister;
+#ifdef RAMPZ
+uint8_t hostRampz;
+#endif
+
+static sigjmp_buf hostResetJump;
+
+static int hostVerbose;
+
+/* Reset by a raw XOFF from xbeemesh, rather than by any input */
+#define HOST_RESET_MARKER 0x13
+static int hostResetMarker;
+
+/* Serial port */
+static int hostFd = -1;
+static unsigned char hostInput[256];
+static size_t hostInputIndex;
+static size_t hostInputLength;
+
+/* UART throttling to the simulated baud rate, 0 if unthrottled */
+static long hostByteNs;
+static struct timespec hostRxNext;
+static struct timespec hostTxNext;
+
+/* Programming delays */
+static long hostSpmUs = HOST_SPM_US;
+static long hostEepromUs = HOST_EEPROM_US;
+
+/* Flash page buffer */
+static uint8_t hostPageBuffer[SPM_PAGESIZE];
+
+static char const *hostFlashFile;
+static char const *hostEepromFile;
+
+/* Current watchdog time-out, 0 if disabled */
+static long hostWatchdogMs;
+
+static void hostLog(char const *format, ...)
+  __attribute__ ((format (printf, 1, 2)));
+
+static void hostLog(char const *format, ...)
+{
+  if (!hostVerbose)
+    return;
+
+  va_list args;
+  va_start(args, format);
+  fprintf(stderr, "xbeeboot_host: ");
+  vfprintf(stderr, format, args);
+  fputc('\n', stderr);
+  va_end(args);
+}
+
+static void hostDelayUs(long us)
+{
+  struct timespec delay;
+  delay.tv_sec = us / 1000000;
+  delay.tv_nsec = (us % 1000000) * 1000;
+  while (nanosleep(&delay, &delay) < 0 && errno == EINTR)
+    ;
+}
+
+/* Whether the time given has come */
+static int hostDue(struct timespec const *when)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return now.tv_sec > when->tv_sec ||
+    (now.tv_sec == when->tv_sec && now.tv_nsec >= when->tv_nsec);
+}
+
+/*
+ * Space out UART bytes at the simulated baud rate.
+ */
+static void hostThrottle(struct timespec *next)
+{
+  if (hostByteNs == 0)
+    return;
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  if (now.tv_sec > next->tv_sec ||
+      (now.tv_sec == next->tv_sec && now.tv_nsec > next->tv_nsec))
+    *next = now;
+  else
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+                           next, NULL) == EINTR)
+      ;
+
+  next->tv_nsec += hostByteNs;
+  while (next->tv_nsec >= 1000000000L) {
+    next->tv_nsec -= 1000000000L;
+    next->tv_sec++;
+  }
+}
+
+static void hostLoad(char const *file, uint8_t *memory, size_t size)
+{
+  memset(memory, 0xff, size);
+
+  if (file == NULL)
+    return;
+
+  FILE *f = fopen(file, "rb");
+  if (f == NULL)
+    /* Starts out erased */
+    return;
+
+  if (fread(memory, 1, size, f) == 0 && ferror(f))
+    perror(file);
+  fclose(f);
+}
+
+static void hostSave(char const *file, uint8_t const *memory, size_t size)
+{
+  if (file == NULL)
+    return;
+
+  FILE *f = fopen(file, "wb");
+  if (f == NULL || fwrite(memory, 1, size, f) != size)
+    perror(file);
+  if (f != NULL)
+    fclose(f);
+}
+
+/*
+ * Watchdog.
+ */
+
+static void hostWatchdogArm(void)
+{
+  struct itimerval timer;
+  memset(&timer, 0, sizeof(timer));
+  timer.it_value.tv_sec = hostWatchdogMs / 1000;
+  timer.it_value.tv_usec = (hostWatchdogMs % 1000) * 1000;
+  setitimer(ITIMER_REAL, &timer, NULL);
+}
+
+static void hostWatchdogExpired(int signum)
+{
+  (void)signum;
+
+  /* Watchdog reset */
+  hostMcusr |= _BV(WDRF);
+  siglongjmp(hostResetJump, 1);
+}
+
+void hostWatchdogReset(void)
+{
+  if (hostWatchdogMs > 0)
+    hostWatchdogArm();
+}
+
+void hostWatchdogConfig(uint8_t x)
+{
+  if (x & _BV(WDE)) {
+    const unsigned int prescale =
+      (x & (_BV(WDP2) | _BV(WDP1) | _BV(WDP0))) | ((x & _BV(WDP3)) ? 8 : 0);
+    hostWatchdogMs = 16L << prescale;
+  } else {
+    hostWatchdogMs = 0;
+  }
+
+  hostWatchdogArm();
+}
+
+/*
+ * UART.
+ */
+
+uint8_t hostUartGetch(void)
+{
+  while (hostInputIndex == hostInputLength) {
+    const ssize_t rc = read(hostFd, hostInput, sizeof(hostInput));
+    if (rc > 0) {
+      hostInputIndex = 0;
+      hostInputLength = rc;
+    } else if (rc == 0 || (errno != EINTR && errno != EAGAIN)) {
+      perror("xbeeboot_host: read");
+      exit(1);
+    }
+  }
+
+  hostThrottle(&hostRxNext);
+
+  if (hostResetMarker && hostInput[hostInputIndex] == HOST_RESET_MARKER) {
+    /* XOFF is always escaped in API mode 2, so this is a reset */
+    hostInputIndex++;
+    hostMcusr = _BV(EXTRF);
+    siglongjmp(hostResetJump, 1);
+  }
+
+  /* As on the AVR, a clean character resets the watchdog */
+  hostWatchdogReset();
+
+  return hostInput[hostInputIndex++];
+}
+
+/*
+ * Whether a character is waiting, as RXC0.  Waits up to a millisecond
+ * for one, so that callers polling this don't spin the CPU.
+ */
+uint8_t hostUartReady(void)
+{
+  if (hostInputIndex < hostInputLength) {
+    /* Not until it would have arrived at the simulated baud rate */
+    if (hostByteNs == 0)
+      return 1;
+
+    return hostDue(&hostRxNext);
+  }
+
+  struct pollfd fds;
+  fds.fd = hostFd;
+  fds.events = POLLIN;
+  return poll(&fds, 1, 1) > 0;
+}
+
+/* Whether another character can be sent yet, as UDRE0 */
+uint8_t hostUartSendReady(void)
+{
+  return hostByteNs == 0 || hostDue(&hostTxNext);
+}
+
+void hostUartPutch(uint8_t ch)
+{
+  hostThrottle(&hostTxNext);
+
+  while (write(hostFd, &ch, 1) != 1)
+    if (errno != EINTR && errno != EAGAIN) {
+      perror("xbeeboot_host: write");
+      exit(1);
+    }
+}
+
+/*
+ * Timer1.
+ */
+
+static uint16_t hostTimer1Start;
+static struct timespec hostTimer1Written;
+static uint16_t hostTimer1Value;
+static uint16_t hostTimer1Seen;
+static struct timespec hostTimer1Access;
+static uint8_t hostTimer1Flag;
+
+/*
+ * Bring TCNT1 and TOV1 up to date.  The bootloader writes TCNT1
+ * through the pointer we last handed out, so a value other than the
+ * one we left there was written at that access.
+ */
+static void hostTimer1Update(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  if (hostTimer1Value != hostTimer1Seen) {
+    hostTimer1Start = hostTimer1Value;
+    hostTimer1Written = hostTimer1Access;
+  }
+
+  long long count = hostTimer1Start;
+  if (hostTimerRegister != 0)
+    count += ((now.tv_sec - hostTimer1Written.tv_sec) * 1000000000LL +
+              (now.tv_nsec - hostTimer1Written.tv_nsec)) *
+      (F_CPU / 1024) / 1000000000LL;
+
+  hostTimer1Flag = count > 0xffff ? _BV(TOV1) : 0;
+  hostTimer1Value = hostTimer1Seen = count;
+  hostTimer1Access = now;
+}
+
+uint16_t *hostTimer1Count(void)
+{
+  hostTimer1Update();
+  return &hostTimer1Value;
+}
+
+uint8_t *hostTimer1Flags(void)
+{
+  hostTimer1Update();
+  return &hostTimer1Flag;
+}
+
+/*
+ * Flash self-programming.
+ */
+
+void hostPageErase(uint16_t address)
+{
+  const uint32_t page = HOST_FLASH_ADDRESS(address) & ~(SPM_PAGESIZE - 1);
+  if (!eeprom_is_ready()) {
+    /* As on the AVR, SPM does nothing while EEPROM is being written */
+    hostLog("erase page 0x%05lx ignored, EEPROM busy", (unsigned long)page);
+    return;
+  }
+  hostLog("erase page 0x%05lx", (unsigned long)page);
+  memset(&hostFlash[page], 0xff, SPM_PAGESIZE);
+  hostDelayUs(hostSpmUs);
+}
+
+void hostPageFill(uint16_t address, uint16_t data)
+{
+  const uint16_t offset = address & (SPM_PAGESIZE - 2);
+  hostPageBuffer[offset] = data & 0xff;
+  hostPageBuffer[offset + 1] = data >> 8;
+}
+
+void hostPageWrite(uint16_t address)
+{
+  const uint32_t page = HOST_FLASH_ADDRESS(address) & ~(SPM_PAGESIZE - 1);
+  if (!eeprom_is_ready()) {
+    hostLog("write page 0x%05lx ignored, EEPROM busy", (unsigned long)page);
+    return;
+  }
+  hostLog("write page 0x%05lx", (unsigned long)page);
+
+  /* Programming can only clear bits */
+  uint16_t index;
+  for (index = 0; index < SPM_PAGESIZE; index++)
+    hostFlash[page + index] &= hostPageBuffer[index];
+  memset(hostPageBuffer, 0xff, sizeof(hostPageBuffer));
+  hostDelayUs(hostSpmUs);
+
+  hostSave(hostFlashFile, hostFlash, sizeof(hostFlash));
+}
+
+/*
+ * EEPROM.
+ */
+
+/*
+ * As with avr-libc, a write returns once started, and both reads and
+ * writes first wait for the previous write to finish.
+ */
+
+/* When the write in progress finishes */
+static struct timespec hostEepromDone;
+
+uint8_t eeprom_is_ready(void)
+{
+  return hostDue(&hostEepromDone);
+}
+
+static void hostEepromWait(void)
+{
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+                         &hostEepromDone, NULL) == EINTR)
+    ;
+}
+
+void eeprom_busy_wait(void)
+{
+  hostEepromWait();
+}
+
+uint8_t eeprom_read_byte(const uint8_t *p)
+{
+  hostEepromWait();
+  return hostEeprom[(uintptr_t)p & E2END];
+}
+
+void eeprom_write_byte(uint8_t *p, uint8_t value)
+{
+  hostEepromWait();
+  hostEeprom[(uintptr_t)p & E2END] = value;
+  hostSave(hostEepromFile, hostEeprom, sizeof(hostEeprom));
+
+  clock_gettime(CLOCK_MONOTONIC, &hostEepromDone);
+  hostEepromDone.tv_nsec += hostEepromUs * 1000;
+  while (hostEepromDone.tv_nsec >= 1000000000L) {
+    hostEepromDone.tv_nsec -= 1000000000L;
+    hostEepromDone.tv_sec++;
+  }
+}
+
+void eeprom_update_byte(uint8_t *p, uint8_t value)
+{
+  if (eeprom_read_byte(p) != value)
+    eeprom_write_byte(p, value);
+}
+
+void eeprom_update_word(uint16_t *p, uint16_t value)
+{
+  uint8_t *bytes = (uint8_t *)p;
+  eeprom_update_byte(bytes, value & 0xff);
+  eeprom_update_byte(bytes + 1, value >> 8);
+}
+
+/*
+ * The application.  Wait for the programmer to come along and reset
+ * us into the bootloader.
+ */
+void hostAppStart(uint8_t rstFlags)
+{
+  hostLog("application started, reset flags 0x%02x", rstFlags);
+
+  if (hostResetMarker) {
+    /* The application ignores everything but the reset line */
+    for (;;) {
+      while (hostInputIndex < hostInputLength)
+        if (hostInput[hostInputIndex++] == HOST_RESET_MARKER)
+          goto reset;
+
+      const ssize_t rc = read(hostFd, hostInput, sizeof(hostInput));
+      if (rc > 0) {
+        hostInputIndex = 0;
+        hostInputLength = rc;
+      } else if (rc == 0 || (errno != EINTR && errno != EAGAIN)) {
+        perror("xbeeboot_host: read");
+        exit(1);
+      }
+    }
+  } else {
+    struct pollfd pfd;
+    pfd.fd = hostFd;
+    pfd.events = POLLIN;
+    while (hostInputIndex == hostInputLength &&
+           poll(&pfd, 1, -1) < 0 && errno == EINTR)
+      ;
+  }
+
+ reset:
+
+  /* External reset */
+  hostMcusr = _BV(EXTRF);
+  siglongjmp(hostResetJump, 1);
+}
+
+static int hostOpenPty(void)
+{
+  const int fd = posix_openpt(O_RDWR | O_NOCTTY);
+  if (fd < 0 || grantpt(fd) < 0 || unlockpt(fd) < 0) {
+    perror("xbeeboot_host: pty");
+    exit(1);
+  }
+
+  char const *name = ptsname(fd);
+
+  /*
+   * Hold the terminal side open ourselves, so that the programmer can
+   * come and go without the pty hanging up.  It must be raw, or the
+   * terminal would echo our output straight back to us.
+   */
+  const int slave = open(name, O_RDWR | O_NOCTTY);
+  struct termios tio;
+  if (slave < 0 || tcgetattr(slave, &tio) < 0) {
+    perror(name);
+    exit(1);
+  }
+  cfmakeraw(&tio);
+  tcsetattr(slave, TCSANOW, &tio);
+
+  printf("XBeeBoot simulator on %s\n", name);
+  fflush(stdout);
+
+  return fd;
+}
+
+static int hostOpenTty(char const *name)
+{
+  const int fd = open(name, O_RDWR | O_NOCTTY);
+  struct termios tio;
+  if (fd < 0 || tcgetattr(fd, &tio) < 0) {
+    perror(name);
+    exit(1);
+  }
+  cfmakeraw(&tio);
+  tcsetattr(fd, TCSANOW, &tio);
+
+  return fd;
+}
+
+static void hostUsage(char const *name)
+{
+  fprintf(stderr,
+          "Usage: %s [-v] [-b baud] [-s us] [-f flash.bin] "
+          "[-e eeprom.bin] [-p tty] [-r]\n"
+          "  -v  Log resets and programming\n"
+          "  -b  Simulated UART baud rate, 0 for unthrottled "
+          "(default %ld)\n"
+          "  -s  Flash page erase/write time in us, 0 for no "
+          "programming delays (default %d)\n"
+          "  -f  Flash image, loaded at start and saved on every write\n"
+          "  -e  EEPROM image, loaded at start and saved on every write\n"
+          "  -p  Use an existing serial device, rather than a new pty\n"
+          "  -r  Reset only on a raw XOFF, as sent by xbeemesh\n",
+          name, (long)BAUD_RATE, HOST_SPM_US);
+  exit(2);
+}
+
+int main(int argc, char **argv)
+{
+  long baud = BAUD_RATE;
+  char const *tty = NULL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "vb:s:f:e:p:r")) != -1) {
+    switch (opt) {
+    case 'v':
+      hostVerbose = 1;
+      break;
+    case 'b':
+      baud = atol(optarg);
+      break;
+    case 's':
+      hostSpmUs = atol(optarg);
+      if (hostSpmUs == 0)
+        hostEepromUs = 0;
+      break;
+    case 'f':
+      hostFlashFile = optarg;
+      break;
+    case 'e':
+      hostEepromFile = optarg;
+      break;
+    case 'p':
+      tty = optarg;
+      break;
+    case 'r':
+      hostResetMarker = 1;
+      break;
+    default:
+      hostUsage(argv[0]);
+    }
+  }
+
+  if (optind != argc || baud < 0 || hostSpmUs < 0)
+    hostUsage(argv[0]);
+
+  /* Start bit, eight data bits and a stop bit */
+  hostByteNs = baud > 0 ? 10 * 1000000000L / baud : 0;
+
+  hostLoad(hostFlashFile, hostFlash, sizeof(hostFlash));
+  hostLoad(hostEepromFile, hostEeprom, sizeof(hostEeprom));
+  memset(hostPageBuffer, 0xff, sizeof(hostPageBuffer));
+
+  hostFd = tty != NULL ? hostOpenTty(tty) : hostOpenPty();
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = hostWatchdogExpired;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGALRM, &action, NULL);
+
+  hostMcusr = _BV(PORF);
+
+  /* Every reset comes back to here */
+  sigsetjmp(hostResetJump, 1);
+
+  hostLog("reset, MCUSR 0x%02x", hostMcusr);
+
+#ifdef RAMPZ
+  hostRampz = 0;
+#endif
+
+  /* After a watchdog reset, the watchdog remains enabled */
+  hostWatchdogConfig((hostMcusr & _BV(WDRF)) ? _BV(WDE) : 0);
+
+  xbeebootMain();
+
+  /* Not reached, the bootloader exits via appStart() */
+  return 1;
+}
@@ -0,0 +1,153 @@
+/*
+ * Host-native build support for XBeeBoot.
+ *
+ * Stands in for <avr/io.h>, <avr/pgmspace.h>, <avr/eeprom.h>, "boot.h"
+ * and "pin_defs.h" when xbeeboot.c is built with XBEEBOOT_HOST, so
+ * that the bootloader can run as an ordinary process against a
+ * simulated ATmega328P, or an ATmega1284P with HOST_ATMEGA1284P.  See
+ * xbeeboot_host.c.
+ *
+ * Copyright (C) 2015-2020 David Sainty
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef _XBEEBOOT_HOST_H_
+#define _XBEEBOOT_HOST_H_
+
+#include <stdint.h>
+
+#if defined(HOST_ATMEGA1284P)
+/* ATmega1284P */
+#define SPM_PAGESIZE 256
+#define FLASHEND 0x1ffff
+#define E2END 0xfff
+#define RAMSIZE 16384
+#define SIGNATURE_0 0x1e
+#define SIGNATURE_1 0x97
+#define SIGNATURE_2 0x05
+
+/* Flash above 64KiB is reached through RAMPZ */
+extern uint8_t hostRampz;
+#define RAMPZ hostRampz
+#define HOST_FLASH_ADDRESS(address) \
+  (((uint32_t)hostRampz << 16) | (uint16_t)(address))
+#else
+/* ATmega328P */
+#define SPM_PAGESIZE 128
+#define FLASHEND 0x7fff
+#define E2END 0x3ff
+#define RAMSIZE 2048
+#define SIGNATURE_0 0x1e
+#define SIGNATURE_1 0x95
+#define SIGNATURE_2 0x0f
+
+#define HOST_FLASH_ADDRESS(address) ((uint16_t)(address))
+#endif
+
+#define _BV(bit) (1 << (bit))
+
+/* Simulated RAM, flash and EEPROM */
+extern uint8_t hostRam[RAMSIZE];
+extern uint8_t hostFlash[FLASHEND + 1];
+extern uint8_t hostEeprom[E2END + 1];
+
+/*
+ * The bootloader addresses its variables relative to RAMSTART, so
+ * point that at the simulated RAM.
+ */
+#define RAMSTART ((uintptr_t)hostRam)
+
+/* Reset cause */
+extern uint8_t hostMcusr;
+#define MCUSR hostMcusr
+#define PORF 0
+#define EXTRF 1
+#define BORF 2
+#define WDRF 3
+
+/* Watchdog, as on the ATmega328P */
+#define WDP0 0
+#define WDP1 1
+#define WDP2 2
+#define WDE 3
+#define WDCE 4
+#define WDP3 5
+
+void hostWatchdogReset(void);
+void hostWatchdogConfig(uint8_t x);
+
+/*
+ * The UART is simulated in uartGetch()/uartPutch(), so the control
+ * registers are simply ignored.
+ */
+extern uint8_t hostUartRegister;
+#define UART_SRA hostUartRegister
+#define UART_SRB hostUartRegister
+#define UART_SRC hostUartRegister
+#define UART_SRL hostUartRegister
+#define U2X0 1
+#define RXEN0 4
+#define TXEN0 3
+#define UCSZ00 1
+#define UCSZ01 2
+
+uint8_t hostUartGetch(void);
+void hostUartPutch(uint8_t ch);
+uint8_t hostUartReady(void);
+uint8_t hostUartSendReady(void);
+
+/*
+ * Timer1, counting up at F_CPU/1024 in host time, for flash_led() and
+ * the retransmit timer.  TOV1 reads as set once the count has wrapped
+ * since TCNT1 was last written, and writes to TIFR1 are dropped, as
+ * the bootloader always clears TOV1 straight after writing TCNT1.
+ */
+extern uint8_t hostTimerRegister;
+#define TCCR1B hostTimerRegister
+#define TCNT1 (*hostTimer1Count())
+#define TIFR1 (*hostTimer1Flags())
+#define CS10 0
+#define CS12 2
+#define TOV1 0
+
+uint16_t *hostTimer1Count(void);
+uint8_t *hostTimer1Flags(void);
+
+/* Flash */
+#define RWWSRE 4
+
+void hostPageErase(uint16_t address);
+void hostPageFill(uint16_t address, uint16_t data);
+void hostPageWrite(uint16_t address);
+
+#define __boot_page_erase_short(address) hostPageErase(address)
+#define __boot_page_fill_short(address, data) hostPageFill(address, data)
+#define __boot_page_write_short(address) hostPageWrite(address)
+#define boot_spm_busy_wait() do { } while (0)
+#define boot_rww_enable() do { } while (0)
+
+/* Stands in for lpm, or elpm where there is RAMPZ */
+#define pgm_read_byte_near(address) (hostFlash[HOST_FLASH_ADDRESS(address)])
+
+/* EEPROM */
+uint8_t eeprom_is_ready(void);
+void eeprom_busy_wait(void);
+uint8_t eeprom_read_byte(const uint8_t *p);
+void eeprom_write_byte(uint8_t *p, uint8_t value);
+void eeprom_update_byte(uint8_t *p, uint8_t value);
+void eeprom_update_word(uint16_t *p, uint16_t value);
+
+/* Leaving the bootloader */
+void hostAppStart(uint8_t rstFlags) __attribute__ ((noreturn));
+
+/*
+ * The bootloader's main() is called by the simulator after every
+ * simulated reset.
+ */
+#define main xbeebootMain
+
+#endif /* _XBEEBOOT_HOST_H_ */
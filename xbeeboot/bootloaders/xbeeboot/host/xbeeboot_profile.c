@@ -0,0 +1,822 @@
+/*
+ * Cycle profile of a built XBeeBoot under simavr.
+ *
+ * Runs a bootloader ELF, eg xbeeboot_atmega328.elf, on a simulated AVR
+ * and drives it in direct mode through a scripted session: sync, read
+ * the signature, write and read back a number of flash pages, and
+ * leave programming mode.  Every executed instruction is charged to
+ * the function containing it, so that the cost of poll(), escGetch(),
+ * transmit() and friends can be measured per received byte and per
+ * page:
+ *
+ *   make atmega328 profile
+ *   ./xbeeboot_profile xbeeboot_atmega328.elf
+ *
+ * Cycles spent spinning on the UART status register are counted as
+ * UART wait rather than against the function doing the spinning.
+ * simavr paces the UART at the baud rate the bootloader programs, so
+ * the wait is the time the bootloader spends idle waiting for the
+ * link.  Static inline functions, such as writebuffer(), are charged
+ * to their caller.
+ *
+ * Copyright (C) 2015-2020 David Sainty
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <fcntl.h>
+#include <gelf.h>
+#include <libelf.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_io.h"
+#include "sim_irq.h"
+#include "avr_uart.h"
+
+#define PROFILE_MAX_CHUNK 54
+#define PROFILE_MAX_FRAME 256
+#define PROFILE_MAX_SYMBOLS 256
+#define PROFILE_MAX_COMMANDS 512
+
+/* MCUSR, the same data address on all the supported AVRs */
+#define PROFILE_MCUSR 0x54
+#define PROFILE_EXTRF 1
+
+/* STK500 */
+#define STK_OK 0x10
+#define STK_INSYNC 0x14
+#define CRC_EOP 0x20
+#define STK_GET_SYNC 0x30
+#define STK_LEAVE_PROGMODE 0x51
+#define STK_LOAD_ADDRESS 0x55
+#define STK_PROG_PAGE 0x64
+#define STK_READ_PAGE 0x74
+#define STK_READ_SIGN 0x75
+
+struct ProfileSymbol {
+  char const *name;
+  uint32_t address;
+  uint32_t size;
+  uint64_t cycles;
+};
+
+enum ProfileKind {
+  KIND_OTHER,
+  KIND_PROG_PAGE,
+  KIND_READ_PAGE,
+  KIND_COUNT
+};
+
+struct ProfileCommand {
+  enum ProfileKind kind;
+  size_t length;
+  uint8_t data[4 + 256 + 1];
+  /* Expected reply length, including STK_INSYNC and STK_OK */
+  size_t replyLength;
+};
+
+static struct ProfileSymbol profileSymbols[PROFILE_MAX_SYMBOLS];
+static int profileSymbolCount;
+
+static avr_t *avr;
+static avr_irq_t *profileUartInput;
+
+/* Scripted session */
+static struct ProfileCommand profileCommands[PROFILE_MAX_COMMANDS];
+static int profileCommandCount;
+static int profileCommand;
+static size_t profileChunk;
+static uint8_t profileSequence;
+static int profileAcked;
+static uint8_t profileReply[PROFILE_MAX_FRAME * 2];
+static size_t profileReplyLength;
+static uint8_t profileLastReplySequence;
+static avr_cycle_count_t profileSentAt;
+static avr_cycle_count_t profileRetransmitCycles;
+static int profileDone;
+
+/* Bytes queued for the AVR's UART */
+static uint8_t profileQueue[4096];
+static size_t profileQueueHead;
+static size_t profileQueueTail;
+static int profileXon = 1;
+
+/* Frame parser for bytes from the AVR's UART */
+static uint8_t profileFrame[PROFILE_MAX_FRAME];
+static size_t profileFrameIndex;
+static size_t profileFrameLength;
+static int profileEscaped;
+
+/* Measurements */
+static uint64_t profileRxBytes;
+static uint64_t profileTxBytes;
+static uint64_t profileRxWait;
+static uint64_t profileTxWait;
+static uint64_t profileOther;
+static uint64_t profileBusy;
+static uint64_t profileFrames;
+static uint64_t profileRetransmits;
+static uint64_t profileKindBusy[KIND_COUNT];
+static uint64_t profileKindCount[KIND_COUNT];
+static uint64_t profileCommandBusy;
+
+static int profileVerbose;
+
+/*
+ * Symbols.
+ */
+
+static int profileSymbolCompare(const void *a, const void *b)
+{
+  const struct ProfileSymbol *x = a;
+  const struct ProfileSymbol *y = b;
+  return x->address < y->address ? -1 : x->address > y->address;
+}
+
+static void profileLoadSymbols(char const *file)
+{
+  elf_version(EV_CURRENT);
+
+  const int fd = open(file, O_RDONLY);
+  Elf *elf = fd < 0 ? NULL : elf_begin(fd, ELF_C_READ, NULL);
+  if (elf == NULL) {
+    perror(file);
+    exit(1);
+  }
+
+  Elf_Scn *scn = NULL;
+  while ((scn = elf_nextscn(elf, scn)) != NULL) {
+    GElf_Shdr shdr;
+    if (gelf_getshdr(scn, &shdr) == NULL || shdr.sh_type != SHT_SYMTAB)
+      continue;
+
+    Elf_Data *data = elf_getdata(scn, NULL);
+    const size_t count = shdr.sh_size / shdr.sh_entsize;
+    size_t index;
+    for (index = 0; index < count; index++) {
+      GElf_Sym sym;
+      if (gelf_getsym(data, index, &sym) == NULL ||
+          GELF_ST_TYPE(sym.st_info) != STT_FUNC || sym.st_size == 0 ||
+          profileSymbolCount == PROFILE_MAX_SYMBOLS)
+        continue;
+
+      struct ProfileSymbol *symbol = &profileSymbols[profileSymbolCount++];
+      symbol->name = strdup(elf_strptr(elf, shdr.sh_link, sym.st_name));
+      symbol->address = sym.st_value;
+      symbol->size = sym.st_size;
+      symbol->cycles = 0;
+    }
+  }
+
+  elf_end(elf);
+  close(fd);
+
+  qsort(profileSymbols, profileSymbolCount, sizeof(profileSymbols[0]),
+        profileSymbolCompare);
+}
+
+static struct ProfileSymbol *profileSymbolAt(uint32_t pc)
+{
+  static struct ProfileSymbol *last;
+  if (last != NULL && pc >= last->address && pc < last->address + last->size)
+    return last;
+
+  int low = 0;
+  int high = profileSymbolCount - 1;
+  while (low <= high) {
+    const int middle = (low + high) / 2;
+    struct ProfileSymbol *symbol = &profileSymbols[middle];
+    if (pc < symbol->address)
+      high = middle - 1;
+    else if (pc >= symbol->address + symbol->size)
+      low = middle + 1;
+    else
+      return last = symbol;
+  }
+
+  return NULL;
+}
+
+static struct ProfileSymbol *profileSymbolNamed(char const *name)
+{
+  int index;
+  for (index = 0; index < profileSymbolCount; index++)
+    if (strcmp(profileSymbols[index].name, name) == 0)
+      return &profileSymbols[index];
+  return NULL;
+}
+
+/*
+ * UART wait detection.  The bootloader spins on the UART status
+ * register with either "lds rN,UCSRnA; sbrs rN,bit; rjmp" or "sbis
+ * UCSRnA,bit; rjmp".  While the awaited bit is clear, the loop is
+ * charged to UART wait.
+ */
+
+static int profileIsUartStatus(uint16_t address)
+{
+  /* UCSR0A..UCSR3A, and UCSRA on the ATmega8 */
+  return address == 0xc0 || address == 0xc8 || address == 0xd0 ||
+    address == 0x130 || address == 0x2b;
+}
+
+static uint16_t profileWord(uint32_t pc)
+{
+  return avr->flash[pc] | (avr->flash[pc + 1] << 8);
+}
+
+static uint32_t profileWaitStart;
+static uint32_t profileWaitEnd;
+static int profileWaitBit;
+
+/*
+ * Return the UART status bit the instruction at pc is spinning on, or
+ * -1 if it isn't spinning.
+ */
+static int profileWaiting(uint32_t pc)
+{
+  if (pc >= profileWaitStart && pc < profileWaitEnd)
+    return profileWaitBit;
+  profileWaitEnd = 0;
+
+  const uint16_t word = profileWord(pc);
+  uint16_t address;
+  uint32_t end;
+  int bit;
+
+  if ((word & 0xfe0f) == 0x9000) {
+    /* lds rN,k */
+    const uint16_t next = profileWord(pc + 4);
+    address = profileWord(pc + 2);
+    if ((next & 0xfe08) != 0xfe00 ||
+        ((next >> 4) & 0x1f) != ((word >> 4) & 0x1f))
+      /* Not followed by sbrs rN,bit */
+      return -1;
+    bit = next & 7;
+    end = pc + 8;
+  } else if ((word & 0xff00) == 0x9b00) {
+    /* sbis A,bit */
+    address = ((word >> 3) & 0x1f) + 0x20;
+    bit = word & 7;
+    end = pc + 4;
+  } else {
+    return -1;
+  }
+
+  if (!profileIsUartStatus(address) || (avr->data[address] & (1 << bit)))
+    return -1;
+
+  profileWaitStart = pc;
+  profileWaitEnd = end;
+  profileWaitBit = bit;
+  return bit;
+}
+
+/*
+ * Bytes to the AVR.
+ */
+
+static void profilePump(void)
+{
+  while (profileXon && profileQueueHead != profileQueueTail) {
+    avr_raise_irq(profileUartInput, profileQueue[profileQueueHead]);
+    profileQueueHead = (profileQueueHead + 1) % sizeof(profileQueue);
+    profileRxBytes++;
+  }
+}
+
+static void profileQueueByte(uint8_t ch)
+{
+  profileQueue[profileQueueTail] = ch;
+  profileQueueTail = (profileQueueTail + 1) % sizeof(profileQueue);
+}
+
+static void profileQueueEscaped(uint8_t ch)
+{
+  if (ch == 0x7d || ch == 0x7e || ch == 0x11 || ch == 0x13) {
+    profileQueueByte(0x7d);
+    ch ^= 0x20;
+  }
+  profileQueueByte(ch);
+}
+
+/*
+ * Send an XBee packet to the bootloader as a ZigBee Receive Packet
+ * (0x90), as a directly attached programmer would.
+ */
+static void profileSendPacket(const uint8_t *packet, size_t length)
+{
+  uint8_t frame[PROFILE_MAX_FRAME];
+  size_t frameLength = 0;
+
+  frame[frameLength++] = 0x90;
+  memset(&frame[frameLength], 0, 10); /* Source address */
+  frameLength += 10;
+  frame[frameLength++] = 0x01; /* Packet acknowledged */
+  memcpy(&frame[frameLength], packet, length);
+  frameLength += length;
+
+  uint8_t checksum = 0xff;
+  size_t index;
+  profileQueueByte(0x7e);
+  profileQueueEscaped(frameLength >> 8);
+  profileQueueEscaped(frameLength & 0xff);
+  for (index = 0; index < frameLength; index++) {
+    profileQueueEscaped(frame[index]);
+    checksum -= frame[index];
+  }
+  profileQueueEscaped(checksum);
+
+  profileFrames++;
+  profilePump();
+}
+
+static void profileSendChunk(void)
+{
+  const struct ProfileCommand *command = &profileCommands[profileCommand];
+  size_t length = command->length - profileChunk;
+  if (length > PROFILE_MAX_CHUNK)
+    length = PROFILE_MAX_CHUNK;
+
+  uint8_t packet[3 + PROFILE_MAX_CHUNK];
+  packet[0] = 1; /* REQUEST */
+  packet[1] = profileSequence;
+  packet[2] = 23; /* FIRMWARE_DELIVER */
+  memcpy(&packet[3], &command->data[profileChunk], length);
+
+  profileSendPacket(packet, 3 + length);
+  profileSentAt = avr->cycle;
+}
+
+static void profileNextChunk(void)
+{
+  if (++profileSequence == 0)
+    profileSequence = 1;
+  profileAcked = 0;
+  profileSendChunk();
+}
+
+static void profileStartCommand(void)
+{
+  if (profileVerbose)
+    fprintf(stderr, "xbeeboot_profile: command 0x%02x at cycle %llu\n",
+            (unsigned int)profileCommands[profileCommand].data[0],
+            (unsigned long long)avr->cycle);
+
+  profileChunk = 0;
+  profileCommandBusy = profileBusy;
+  profileNextChunk();
+}
+
+static void profileCheckCommand(void)
+{
+  const struct ProfileCommand *command = &profileCommands[profileCommand];
+
+  if (!profileAcked)
+    return;
+
+  const size_t sent = profileChunk + PROFILE_MAX_CHUNK;
+  if (sent < command->length) {
+    profileChunk = sent;
+    profileNextChunk();
+    return;
+  }
+
+  if (profileReplyLength < command->replyLength)
+    return;
+
+  if (profileReply[0] != STK_INSYNC ||
+      profileReply[command->replyLength - 1] != STK_OK) {
+    fprintf(stderr, "xbeeboot_profile: command 0x%02x failed\n",
+            (unsigned int)command->data[0]);
+    exit(1);
+  }
+
+  profileKindBusy[command->kind] += profileBusy - profileCommandBusy;
+  profileKindCount[command->kind]++;
+
+  profileReplyLength -= command->replyLength;
+  memmove(profileReply, &profileReply[command->replyLength],
+          profileReplyLength);
+
+  if (++profileCommand == profileCommandCount)
+    profileDone = 1;
+  else
+    profileStartCommand();
+}
+
+/*
+ * Bytes from the AVR.
+ */
+
+static void profileFrameReceived(const uint8_t *frame, size_t length)
+{
+  if (length < 16 || frame[0] != 0x10)
+    /* Not a ZigBee Transmit Request carrying a packet */
+    return;
+
+  const uint8_t *packet = &frame[14];
+  const size_t packetLength = length - 14;
+
+  if (packet[0] == 0) {
+    /* ACK */
+    if (packet[1] == profileSequence && !profileAcked) {
+      profileAcked = 1;
+      profileCheckCommand();
+    }
+    return;
+  }
+
+  if (packet[0] != 1 || packetLength < 3 || packet[2] != 24)
+    return;
+
+  /* REQUEST carrying a FIRMWARE_REPLY, acknowledge it */
+  const uint8_t ack[2] = { 0, packet[1] };
+  profileSendPacket(ack, sizeof(ack));
+
+  if (packet[1] == profileLastReplySequence)
+    /* Duplicate */
+    return;
+  profileLastReplySequence = packet[1];
+
+  if (profileReplyLength + packetLength - 3 > sizeof(profileReply)) {
+    fprintf(stderr, "xbeeboot_profile: unexpected reply\n");
+    exit(1);
+  }
+  memcpy(&profileReply[profileReplyLength], &packet[3], packetLength - 3);
+  profileReplyLength += packetLength - 3;
+
+  profileCheckCommand();
+}
+
+static void profileUartOutput(struct avr_irq_t *irq, uint32_t value,
+                              void *param)
+{
+  (void)irq;
+  (void)param;
+
+  uint8_t ch = value;
+  profileTxBytes++;
+
+  if (ch == 0x7e) {
+    profileFrameIndex = 0;
+    profileFrameLength = 0;
+    profileEscaped = 0;
+    return;
+  }
+
+  if (ch == 0x7d) {
+    profileEscaped = 1;
+    return;
+  }
+
+  if (profileEscaped) {
+    ch ^= 0x20;
+    profileEscaped = 0;
+  }
+
+  if (profileFrameIndex < 2) {
+    profileFrameLength = (profileFrameLength << 8) | ch;
+    profileFrameIndex++;
+    return;
+  }
+
+  const size_t offset = profileFrameIndex++ - 2;
+  if (offset < profileFrameLength && offset < sizeof(profileFrame))
+    profileFrame[offset] = ch;
+  else if (offset == profileFrameLength &&
+           profileFrameLength <= sizeof(profileFrame))
+    /* Ignore the checksum, simavr doesn't corrupt bytes */
+    profileFrameReceived(profileFrame, profileFrameLength);
+}
+
+static void profileUartXon(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+  (void)irq;
+  (void)value;
+  (void)param;
+
+  profileXon = 1;
+  profilePump();
+}
+
+static void profileUartXoff(struct avr_irq_t *irq, uint32_t value,
+                            void *param)
+{
+  (void)irq;
+  (void)value;
+  (void)param;
+
+  profileXon = 0;
+}
+
+/*
+ * The scripted session.
+ */
+
+static struct ProfileCommand *profileAddCommand(enum ProfileKind kind,
+                                                size_t replyLength)
+{
+  if (profileCommandCount == PROFILE_MAX_COMMANDS) {
+    fprintf(stderr, "xbeeboot_profile: too many pages\n");
+    exit(2);
+  }
+
+  struct ProfileCommand *command = &profileCommands[profileCommandCount++];
+  command->kind = kind;
+  command->length = 0;
+  command->replyLength = replyLength;
+  return command;
+}
+
+static void profileLoadAddress(uint32_t address)
+{
+  struct ProfileCommand *command = profileAddCommand(KIND_OTHER, 2);
+  /* Word address */
+  command->data[command->length++] = STK_LOAD_ADDRESS;
+  command->data[command->length++] = (address >> 1) & 0xff;
+  command->data[command->length++] = (address >> 9) & 0xff;
+  command->data[command->length++] = CRC_EOP;
+}
+
+static void profileScript(int pages, unsigned int pageSize)
+{
+  struct ProfileCommand *command;
+
+  command = profileAddCommand(KIND_OTHER, 2);
+  command->data[command->length++] = STK_GET_SYNC;
+  command->data[command->length++] = CRC_EOP;
+
+  command = profileAddCommand(KIND_OTHER, 5);
+  command->data[command->length++] = STK_READ_SIGN;
+  command->data[command->length++] = CRC_EOP;
+
+  int page;
+  for (page = 0; page < pages; page++) {
+    profileLoadAddress(page * pageSize);
+
+    command = profileAddCommand(KIND_PROG_PAGE, 2);
+    command->data[command->length++] = STK_PROG_PAGE;
+    command->data[command->length++] = pageSize >> 8;
+    command->data[command->length++] = pageSize & 0xff;
+    command->data[command->length++] = 'F';
+    unsigned int index;
+    for (index = 0; index < pageSize; index++)
+      /* Plenty of bytes needing escapes */
+      command->data[command->length++] = (page * pageSize + index) * 7;
+    command->data[command->length++] = CRC_EOP;
+  }
+
+  for (page = 0; page < pages; page++) {
+    profileLoadAddress(page * pageSize);
+
+    command = profileAddCommand(KIND_READ_PAGE, pageSize + 2);
+    command->data[command->length++] = STK_READ_PAGE;
+    command->data[command->length++] = pageSize >> 8;
+    command->data[command->length++] = pageSize & 0xff;
+    command->data[command->length++] = 'F';
+    command->data[command->length++] = CRC_EOP;
+  }
+
+  command = profileAddCommand(KIND_OTHER, 2);
+  command->data[command->length++] = STK_LEAVE_PROGMODE;
+  command->data[command->length++] = CRC_EOP;
+}
+
+/*
+ * Guess the simavr core and clock from the file name, eg
+ * xbeeboot_atmega328_pro_8MHz.elf.
+ */
+static char const *profileGuessMcu(char const *file, char *mcu, size_t size)
+{
+  char const *name = strstr(file, "atmega");
+  if (name == NULL)
+    return NULL;
+
+  size_t length = 6;
+  while (name[length] >= '0' && name[length] <= '9')
+    length++;
+  if (length + 2 > size)
+    return NULL;
+
+  /* simavr knows the picoPower parts by their "p" names */
+  memcpy(mcu, name, length);
+  mcu[length] = 'p';
+  mcu[length + 1] = '\0';
+  if (strcmp(mcu, "atmega8p") == 0 || strcmp(mcu, "atmega168p") == 0)
+    mcu[length] = '\0';
+
+  return mcu;
+}
+
+static void profileUsage(char const *name)
+{
+  fprintf(stderr,
+          "Usage: %s [-v] [-m mcu] [-f hz] [-n pages] [-P pagesize] "
+          "xbeeboot_<target>.elf\n"
+          "  -m  simavr core (default from the file name)\n"
+          "  -f  Clock frequency (default 16000000, or 8000000 for 8MHz "
+          "targets)\n"
+          "  -n  Flash pages to write and read back (default 16)\n"
+          "  -P  Flash page size in bytes (default 128, or 256 for the "
+          "ATmega644/1284)\n"
+          "  -v  Log the session\n",
+          name);
+  exit(2);
+}
+
+int main(int argc, char **argv)
+{
+  char const *mcu = NULL;
+  unsigned long frequency = 0;
+  int pages = 16;
+  unsigned int pageSize = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "vm:f:n:P:")) != -1) {
+    switch (opt) {
+    case 'v':
+      profileVerbose = 1;
+      break;
+    case 'm':
+      mcu = optarg;
+      break;
+    case 'f':
+      frequency = strtoul(optarg, NULL, 0);
+      break;
+    case 'n':
+      pages = atoi(optarg);
+      break;
+    case 'P':
+      pageSize = atoi(optarg);
+      break;
+    default:
+      profileUsage(argv[0]);
+    }
+  }
+
+  if (optind != argc - 1 || pages < 1)
+    profileUsage(argv[0]);
+
+  char const *file = argv[optind];
+  char guessedMcu[32];
+  if (mcu == NULL &&
+      (mcu = profileGuessMcu(file, guessedMcu, sizeof(guessedMcu))) == NULL)
+    profileUsage(argv[0]);
+  if (frequency == 0)
+    frequency = strstr(file, "8MHz") != NULL ? 8000000 : 16000000;
+  if (pageSize == 0)
+    pageSize = (strstr(mcu, "644") || strstr(mcu, "1284")) ? 256 : 128;
+  if (pageSize > 256 || (pageSize & (pageSize - 1)) != 0)
+    profileUsage(argv[0]);
+
+  elf_firmware_t firmware;
+  memset(&firmware, 0, sizeof(firmware));
+  if (elf_read_firmware(file, &firmware) != 0) {
+    fprintf(stderr, "xbeeboot_profile: can't load %s\n", file);
+    return 1;
+  }
+  profileLoadSymbols(file);
+
+  avr = avr_make_mcu_by_name(mcu);
+  if (avr == NULL) {
+    fprintf(stderr, "xbeeboot_profile: simavr doesn't know %s\n", mcu);
+    return 1;
+  }
+  avr_init(avr);
+  avr->frequency = frequency;
+  avr->log = profileVerbose ? LOG_TRACE : LOG_ERROR;
+  avr_load_firmware(avr, &firmware);
+
+  /* Enter the bootloader, as if after an external reset */
+  avr->pc = firmware.flashbase;
+  avr->data[PROFILE_MCUSR] = 1 << PROFILE_EXTRF;
+
+  /* Take over UART 0 */
+  uint32_t flags = 0;
+  avr_ioctl(avr, AVR_IOCTL_UART_GET_FLAGS('0'), &flags);
+  flags &= ~AVR_UART_FLAG_STDIO;
+  avr_ioctl(avr, AVR_IOCTL_UART_SET_FLAGS('0'), &flags);
+
+  profileUartInput =
+    avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_INPUT);
+  avr_irq_register_notify(
+    avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_OUTPUT),
+    profileUartOutput, NULL);
+  avr_irq_register_notify(
+    avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_OUT_XON),
+    profileUartXon, NULL);
+  avr_irq_register_notify(
+    avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_OUT_XOFF),
+    profileUartXoff, NULL);
+
+  profileScript(pages, pageSize);
+
+  /* Retransmit after 200ms, eg the first frame after a reset */
+  profileRetransmitCycles = frequency / 5;
+  const avr_cycle_count_t limit = (avr_cycle_count_t)frequency * 600;
+
+  profileStartCommand();
+
+  while (!profileDone) {
+    const uint32_t pc = avr->pc;
+    const avr_cycle_count_t before = avr->cycle;
+    const int waiting = profileWaiting(pc);
+
+    const int state = avr_run(avr);
+    if (state == cpu_Done || state == cpu_Crashed) {
+      fprintf(stderr, "xbeeboot_profile: AVR stopped at 0x%04x\n",
+              (unsigned int)avr->pc);
+      return 1;
+    }
+
+    const uint64_t cycles = avr->cycle - before;
+    if (waiting == 7) {
+      profileRxWait += cycles;
+    } else if (waiting >= 0) {
+      profileTxWait += cycles;
+    } else {
+      struct ProfileSymbol *symbol = profileSymbolAt(pc);
+      if (symbol != NULL)
+        symbol->cycles += cycles;
+      else
+        profileOther += cycles;
+      profileBusy += cycles;
+    }
+
+    if (!profileAcked &&
+        avr->cycle - profileSentAt > profileRetransmitCycles) {
+      profileRetransmits++;
+      profileSendChunk();
+    }
+
+    if (avr->cycle > limit) {
+      fprintf(stderr, "xbeeboot_profile: session timed out at command %d\n",
+              profileCommand);
+      return 1;
+    }
+  }
+
+  const uint64_t total = avr->cycle;
+
+  printf("%s: %s at %lu Hz, %d pages of %u bytes\n",
+         file, mcu, frequency, pages, pageSize);
+  printf("  %llu cycles (%.3f s), %llu bytes received in %llu frames "
+         "(%llu retransmitted), %llu bytes sent\n",
+         (unsigned long long)total, (double)total / frequency,
+         (unsigned long long)profileRxBytes,
+         (unsigned long long)profileFrames,
+         (unsigned long long)profileRetransmits,
+         (unsigned long long)profileTxBytes);
+
+  printf("  %-20s %12s %7s\n", "function", "cycles", "%");
+  int index;
+  for (index = 0; index < profileSymbolCount; index++) {
+    const struct ProfileSymbol *symbol = &profileSymbols[index];
+    if (symbol->cycles > 0)
+      printf("  %-20s %12llu %6.2f%%\n", symbol->name,
+             (unsigned long long)symbol->cycles,
+             100.0 * symbol->cycles / total);
+  }
+  if (profileOther > 0)
+    printf("  %-20s %12llu %6.2f%%\n", "(other)",
+           (unsigned long long)profileOther, 100.0 * profileOther / total);
+  printf("  %-20s %12llu %6.2f%%\n", "(UART receive wait)",
+         (unsigned long long)profileRxWait, 100.0 * profileRxWait / total);
+  printf("  %-20s %12llu %6.2f%%\n", "(UART transmit wait)",
+         (unsigned long long)profileTxWait, 100.0 * profileTxWait / total);
+
+  /* Receive path cost, wherever the compiler left it */
+  static char const *const receiveFunctions[] =
+    { "uartGetch", "escGetch", "poll", NULL };
+  uint64_t receive = 0;
+  for (index = 0; receiveFunctions[index] != NULL; index++) {
+    const struct ProfileSymbol *symbol =
+      profileSymbolNamed(receiveFunctions[index]);
+    if (symbol != NULL)
+      receive += symbol->cycles;
+  }
+
+  printf("  receive path (uartGetch, escGetch, poll): %.1f cycles/byte\n",
+         (double)receive / profileRxBytes);
+  printf("  flash page write: %.0f busy cycles/page\n",
+         (double)profileKindBusy[KIND_PROG_PAGE] /
+         profileKindCount[KIND_PROG_PAGE]);
+  printf("  flash page read: %.0f busy cycles/page\n",
+         (double)profileKindBusy[KIND_READ_PAGE] /
+         profileKindCount[KIND_READ_PAGE]);
+  printf("  UART idle: %.1f%% waiting to receive, %.1f%% waiting to "
+         "transmit\n",
+         100.0 * profileRxWait / total, 100.0 * profileTxWait / total);
+
+  return 0;
+}
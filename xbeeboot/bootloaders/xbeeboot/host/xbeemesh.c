@@ -0,0 +1,1088 @@
+/*
+ * Simulated XBee ZigBee mesh.
+ *
+ * Stands in for a coordinator XBee and any number of target XBees,
+ * each presented as a pty speaking API mode 2, so that Over-The-Air
+ * updates can be run end to end without radios:
+ *
+ *   ./xbeemesh -t 0013a20000000001:2
+ *   coordinator 0013a20000000000 on /dev/pts/5
+ *   target 0013a20000000001 on /dev/pts/6
+ *
+ *   ./xbeeboot_host -r -p /dev/pts/6
+ *   avrdude -c xbee -p m328p -P 0013a20000000001@/dev/pts/5 ...
+ *
+ * Only the API frames used by the avrdude xbee programmer and the
+ * bootloader are implemented: local AT commands (0x08/0x88), transmit
+ * and receive (0x10/0x90), remote AT commands (0x17/0x97), Create
+ * Source Route (0x21), Transmit Status (0x8b) and Route Record
+ * Indicators (0xa1).
+ *
+ * Each target sits a configurable number of hops from the
+ * coordinator.  Every hop adds latency and jitter, and loses frames
+ * with a configurable probability.  Unicast transmissions are retried
+ * as an XBee would, so a lost acknowledgement leads to a duplicate
+ * delivery.  The random number generator is seeded, so a given
+ * configuration behaves reproducibly.
+ *
+ * Driving a target's reset pin low (ATD3=4 by default) holds its AVR
+ * in reset, and releasing it (any other value, or ATFR) sends the AVR
+ * a raw XOFF (0x13).  XOFF is always escaped in API mode 2, so
+ * "xbeeboot_host -r" takes it as the end of an external reset.
+ *
+ * Copyright (C) 2015-2020 David Sainty
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MESH_MAX_NODES 32
+#define MESH_MAX_HOPS 10
+#define MESH_FRAME_MAX 512
+#define MESH_MAX_AT 16
+
+#define MESH_RESET_MARKER 0x13
+
+/* Transmit Status delivery status codes */
+#define STATUS_SUCCESS 0x00
+#define STATUS_NETWORK_ACK_FAILURE 0x21
+#define STATUS_ADDRESS_NOT_FOUND 0x24
+#define STATUS_ROUTE_NOT_FOUND 0x25
+#define STATUS_PAYLOAD_TOO_LARGE 0x74
+
+/* Transmit Status discovery status codes */
+#define DISCOVERY_NONE 0x00
+#define DISCOVERY_ROUTE 0x02
+
+/* Remote AT command status codes */
+#define AT_STATUS_OK 0
+#define AT_STATUS_TRANSMISSION_FAILURE 4
+
+/* Transmit options */
+#define TX_OPTION_DISABLE_ACK 0x01
+
+struct MeshAT {
+  char command[2];
+  unsigned char length;
+  unsigned char value[8];
+};
+
+struct MeshNode {
+  unsigned char address64[8];
+  unsigned char address16[2];
+
+  /* Intermediate hops between this node and the coordinator */
+  int hops;
+  unsigned char route[2 * MESH_MAX_HOPS];
+
+  int resetPin;
+  int inReset;
+
+  /* Source route created by the coordinator, -1 if none */
+  int sourceRouteHops;
+  /* Non-zero once the coordinator has discovered a route to us */
+  int routeDiscovered;
+  /* Non-zero once a Route Record Indicator has been sent for us */
+  int routeRecorded;
+  /* Unicasts are sent one at a time, this one finishes then */
+  uint64_t busyUntil;
+
+  struct MeshAT at[MESH_MAX_AT];
+  int atCount;
+
+  int fd;
+  char const *name;
+
+  /* API frame parser */
+  int escaped;
+  size_t index;
+  size_t length;
+  unsigned char frame[MESH_FRAME_MAX];
+};
+
+struct MeshEvent {
+  uint64_t time;
+  uint64_t order;
+  struct MeshNode *node;
+  size_t length;
+  /* Escaped, ready to write */
+  unsigned char data[2 * MESH_FRAME_MAX + 8];
+};
+
+static struct MeshNode meshNodes[MESH_MAX_NODES];
+static int meshNodeCount;
+
+/* Configuration */
+static int meshVerbose;
+static double meshLatencyMs = 10;
+static double meshJitterMs = 5;
+static double meshLoss = 0;
+static double meshDuplicate = 0;
+static unsigned int meshMaxPayload = 84;
+static int meshRetries = 3;
+static double meshAckTimeoutMs = 50;
+static double meshDiscoveryMs = 200;
+static int meshRouteRecordEvery;
+
+/* Statistics */
+static unsigned long meshFrames;
+static unsigned long meshDelivered;
+static unsigned long meshLost;
+static unsigned long meshDuplicated;
+static unsigned long meshFailed;
+
+/* Pending deliveries, a binary heap ordered by time */
+static struct MeshEvent **meshEvents;
+static size_t meshEventCount;
+static size_t meshEventSize;
+static uint64_t meshEventOrder;
+
+static uint64_t meshRandomState = 0x2545f4914f6cdd1dULL;
+
+static volatile sig_atomic_t meshStop;
+
+static void meshLog(char const *format, ...)
+  __attribute__ ((format (printf, 1, 2)));
+
+static void meshLog(char const *format, ...)
+{
+  if (!meshVerbose)
+    return;
+
+  va_list args;
+  va_start(args, format);
+  fprintf(stderr, "xbeemesh: ");
+  vfprintf(stderr, format, args);
+  fputc('\n', stderr);
+  va_end(args);
+}
+
+static uint64_t meshNow(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/* xorshift64* */
+static double meshRandom(void)
+{
+  meshRandomState ^= meshRandomState >> 12;
+  meshRandomState ^= meshRandomState << 25;
+  meshRandomState ^= meshRandomState >> 27;
+  return (double)((meshRandomState * 0x2545f4914f6cdd1dULL) >> 11) /
+    (double)(1ULL << 53);
+}
+
+static uint64_t meshMs(double ms)
+{
+  return (uint64_t)(ms * 1000000.0);
+}
+
+/*
+ * One way latency across the given number of intermediate hops.
+ */
+static uint64_t meshLatency(int hops)
+{
+  uint64_t latency = 0;
+  int hop;
+  for (hop = 0; hop <= hops; hop++)
+    latency += meshMs(meshLatencyMs + meshRandom() * meshJitterMs);
+  return latency;
+}
+
+/*
+ * Return non-zero if a frame survives every link of the path.
+ */
+static int meshSurvives(int hops)
+{
+  int hop;
+  for (hop = 0; hop <= hops; hop++)
+    if (meshRandom() < meshLoss) {
+      meshLost++;
+      return 0;
+    }
+  return 1;
+}
+
+static struct MeshNode *meshCoordinator(void)
+{
+  return &meshNodes[0];
+}
+
+static struct MeshNode *meshFind(const unsigned char *address64)
+{
+  int index;
+  for (index = 0; index < meshNodeCount; index++)
+    if (memcmp(meshNodes[index].address64, address64, 8) == 0)
+      return &meshNodes[index];
+  return NULL;
+}
+
+static int meshPathHops(const struct MeshNode *a, const struct MeshNode *b)
+{
+  return a->hops + b->hops;
+}
+
+/*
+ * Event queue.
+ */
+
+static int meshEventBefore(const struct MeshEvent *a, const struct MeshEvent *b)
+{
+  return a->time < b->time || (a->time == b->time && a->order < b->order);
+}
+
+static struct MeshEvent *meshEventNew(struct MeshNode *node, uint64_t time)
+{
+  struct MeshEvent *event = malloc(sizeof(*event));
+  if (event == NULL) {
+    perror("xbeemesh");
+    exit(1);
+  }
+
+  event->time = time;
+  event->order = meshEventOrder++;
+  event->node = node;
+  event->length = 0;
+
+  if (meshEventCount == meshEventSize) {
+    meshEventSize = meshEventSize ? meshEventSize * 2 : 64;
+    meshEvents = realloc(meshEvents, meshEventSize * sizeof(*meshEvents));
+    if (meshEvents == NULL) {
+      perror("xbeemesh");
+      exit(1);
+    }
+  }
+
+  size_t index = meshEventCount++;
+  while (index > 0) {
+    const size_t parent = (index - 1) / 2;
+    if (!meshEventBefore(event, meshEvents[parent]))
+      break;
+    meshEvents[index] = meshEvents[parent];
+    index = parent;
+  }
+  meshEvents[index] = event;
+
+  return event;
+}
+
+static struct MeshEvent *meshEventPop(void)
+{
+  struct MeshEvent *top = meshEvents[0];
+  struct MeshEvent *last = meshEvents[--meshEventCount];
+
+  size_t index = 0;
+  for (;;) {
+    size_t child = index * 2 + 1;
+    if (child >= meshEventCount)
+      break;
+    if (child + 1 < meshEventCount &&
+        meshEventBefore(meshEvents[child + 1], meshEvents[child]))
+      child++;
+    if (!meshEventBefore(meshEvents[child], last))
+      break;
+    meshEvents[index] = meshEvents[child];
+    index = child;
+  }
+  meshEvents[index] = last;
+
+  return top;
+}
+
+/*
+ * Queue an API frame, escaped for API mode 2, for delivery to a node
+ * at the given time.
+ */
+static void meshQueueFrame(struct MeshNode *node, uint64_t time,
+                           const unsigned char *frame, size_t length)
+{
+  struct MeshEvent *event = meshEventNew(node, time);
+  unsigned char *out = event->data;
+  unsigned char checksum = 0xff;
+  size_t index;
+
+#define MESH_PUT(x)                                             \
+  do {                                                          \
+    const unsigned char v = (x);                                \
+    if (v == 0x7d || v == 0x7e || v == 0x11 || v == 0x13) {     \
+      *out++ = 0x7d;                                            \
+      *out++ = v ^ 0x20;                                        \
+    } else {                                                    \
+      *out++ = v;                                               \
+    }                                                           \
+  } while (0)
+
+  *out++ = 0x7e;
+  MESH_PUT(length >> 8);
+  MESH_PUT(length & 0xff);
+  for (index = 0; index < length; index++) {
+    MESH_PUT(frame[index]);
+    checksum -= frame[index];
+  }
+  MESH_PUT(checksum);
+
+  event->length = out - event->data;
+}
+
+static void meshQueueReset(struct MeshNode *node, uint64_t time)
+{
+  struct MeshEvent *event = meshEventNew(node, time);
+  event->data[0] = MESH_RESET_MARKER;
+  event->length = 1;
+}
+
+static void meshDeliver(struct MeshEvent *event)
+{
+  struct MeshNode *node = event->node;
+
+  if (node->inReset && event->data[0] != MESH_RESET_MARKER) {
+    meshLog("%s is held in reset, frame dropped", node->name);
+    return;
+  }
+
+  if (write(node->fd, event->data, event->length) != (ssize_t)event->length)
+    /* As good as a UART overrun */
+    meshLog("%s: write failed, frame dropped", node->name);
+}
+
+/*
+ * AT command parameters.
+ */
+
+static struct MeshAT *meshAT(struct MeshNode *node, const unsigned char *command)
+{
+  int index;
+  for (index = 0; index < node->atCount; index++)
+    if (memcmp(node->at[index].command, command, 2) == 0)
+      return &node->at[index];
+
+  if (node->atCount == MESH_MAX_AT)
+    return NULL;
+
+  struct MeshAT *at = &node->at[node->atCount++];
+  memcpy(at->command, command, 2);
+  at->length = 1;
+  at->value[0] = 0;
+  return at;
+}
+
+/*
+ * Apply an AT command to a node, returning the parameter value for the
+ * response in *value.
+ */
+static void meshApplyAT(struct MeshNode *node, uint64_t time,
+                        const unsigned char *command,
+                        const unsigned char *param, size_t paramLength,
+                        struct MeshAT const **value)
+{
+  *value = NULL;
+
+  if (command[0] == 'F' && command[1] == 'R') {
+    /* Software reset, pins revert to their defaults */
+    meshLog("%s: ATFR", node->name);
+    node->atCount = 0;
+    node->routeRecorded = 0;
+    if (node->inReset) {
+      node->inReset = 0;
+      meshQueueReset(node, time);
+    }
+    return;
+  }
+
+  struct MeshAT *at = meshAT(node, command);
+  if (at == NULL)
+    return;
+
+  if (paramLength == 0) {
+    *value = at;
+    return;
+  }
+
+  if (paramLength > sizeof(at->value))
+    paramLength = sizeof(at->value);
+  memcpy(at->value, param, paramLength);
+  at->length = paramLength;
+
+  if (command[0] == 'D' && command[1] == '0' + node->resetPin) {
+    if (param[paramLength - 1] == 4) {
+      /* Digital output low, holding the AVR in reset */
+      meshLog("%s: reset asserted", node->name);
+      node->inReset = 1;
+    } else if (node->inReset) {
+      meshLog("%s: reset released", node->name);
+      node->inReset = 0;
+      meshQueueReset(node, time);
+    }
+  }
+}
+
+/*
+ * Local AT Command Request (0x08).
+ */
+static void meshLocalAT(struct MeshNode *node, uint64_t now,
+                        const unsigned char *frame, size_t length)
+{
+  if (length < 4)
+    return;
+
+  struct MeshAT const *value;
+  meshApplyAT(node, now, &frame[2], &frame[4], length - 4, &value);
+
+  if (frame[1] == 0)
+    /* No response requested */
+    return;
+
+  unsigned char response[16];
+  size_t responseLength = 0;
+  response[responseLength++] = 0x88;
+  response[responseLength++] = frame[1];
+  response[responseLength++] = frame[2];
+  response[responseLength++] = frame[3];
+  response[responseLength++] = AT_STATUS_OK;
+  if (value != NULL) {
+    memcpy(&response[responseLength], value->value, value->length);
+    responseLength += value->length;
+  }
+
+  meshQueueFrame(node, now, response, responseLength);
+}
+
+/*
+ * Model an acknowledged unicast across the mesh.  Returns the delivery
+ * status, and the time the source learns it in *statusTime.  Each
+ * delivery of the payload is queued by the deliver callback.
+ */
+static unsigned char meshUnicast(int hops, int acked, uint64_t now,
+                                 uint64_t *statusTime, int *attempts,
+                                 void (*deliver)(uint64_t time, void *context),
+                                 void *context)
+{
+  const int maximum = acked ? 1 + meshRetries : 1;
+  uint64_t time = now;
+
+  for (*attempts = 1; ; (*attempts)++) {
+    const uint64_t sent = time;
+
+    time += meshLatency(hops);
+    const int arrived = meshSurvives(hops);
+    if (arrived) {
+      deliver(time, context);
+      if (meshRandom() < meshDuplicate) {
+        meshDuplicated++;
+        deliver(time, context);
+      }
+    }
+
+    if (!acked) {
+      /* Nobody will ever know if it arrived */
+      *statusTime = sent;
+      return STATUS_SUCCESS;
+    }
+
+    if (arrived) {
+      time += meshLatency(hops);
+      if (meshSurvives(hops)) {
+        *statusTime = time;
+        return STATUS_SUCCESS;
+      }
+    }
+
+    /* Wait for the acknowledgement that never comes, then retry */
+    time = sent + meshMs(meshAckTimeoutMs) + meshLatency(hops) * 2;
+
+    if (*attempts == maximum) {
+      meshFailed++;
+      *statusTime = time;
+      return STATUS_NETWORK_ACK_FAILURE;
+    }
+  }
+}
+
+struct MeshReceive {
+  struct MeshNode *source;
+  struct MeshNode *destination;
+  unsigned char options;
+  const unsigned char *data;
+  size_t length;
+};
+
+static void meshDeliverReceive(uint64_t time, void *context)
+{
+  struct MeshReceive const *receive = context;
+  struct MeshNode *source = receive->source;
+  struct MeshNode *destination = receive->destination;
+
+  if (destination == meshCoordinator() && source->hops > 0 &&
+      (meshRouteRecordEvery || !source->routeRecorded)) {
+    /* Many-to-one routing tells the coordinator the route taken */
+    unsigned char record[16 + 2 * MESH_MAX_HOPS];
+    size_t recordLength = 0;
+    record[recordLength++] = 0xa1;
+    memcpy(&record[recordLength], source->address64, 8);
+    recordLength += 8;
+    memcpy(&record[recordLength], source->address16, 2);
+    recordLength += 2;
+    record[recordLength++] = 0x01; /* Packet acknowledged */
+    record[recordLength++] = source->hops;
+    memcpy(&record[recordLength], source->route, source->hops * 2);
+    recordLength += source->hops * 2;
+
+    meshQueueFrame(destination, time, record, recordLength);
+    source->routeRecorded = 1;
+  }
+
+  unsigned char frame[MESH_FRAME_MAX];
+  size_t length = 0;
+  frame[length++] = 0x90;
+  memcpy(&frame[length], source->address64, 8);
+  length += 8;
+  memcpy(&frame[length], source->address16, 2);
+  length += 2;
+  frame[length++] = receive->options;
+  memcpy(&frame[length], receive->data, receive->length);
+  length += receive->length;
+
+  meshQueueFrame(destination, time, frame, length);
+  meshDelivered++;
+}
+
+/*
+ * ZigBee Transmit Request (0x10).
+ */
+static void meshTransmit(struct MeshNode *source, uint64_t now,
+                         const unsigned char *frame, size_t length)
+{
+  if (length < 14)
+    return;
+
+  const unsigned char frameId = frame[1];
+  const unsigned char options = frame[13];
+  struct MeshNode *destination = meshFind(&frame[2]);
+
+  unsigned char status = STATUS_SUCCESS;
+  unsigned char discovery = DISCOVERY_NONE;
+  uint64_t statusTime;
+  int attempts = 1;
+
+  if (now < source->busyUntil)
+    now = source->busyUntil;
+  statusTime = now;
+
+  if (destination == NULL || destination == source) {
+    status = STATUS_ADDRESS_NOT_FOUND;
+  } else {
+    const int hops = meshPathHops(source, destination);
+    unsigned int maximumPayload = meshMaxPayload;
+
+    if (source == meshCoordinator() && destination->sourceRouteHops >= 0) {
+      /* Source routing costs two bytes, plus two per hop */
+      maximumPayload -= 2 + 2 * destination->sourceRouteHops;
+      if (destination->sourceRouteHops != hops)
+        status = STATUS_ROUTE_NOT_FOUND;
+    } else if (source == meshCoordinator() && hops > 0 &&
+               !destination->routeDiscovered) {
+      /* Route discovery before the first transmission */
+      now += meshMs(meshDiscoveryMs);
+      discovery = DISCOVERY_ROUTE;
+      destination->routeDiscovered = 1;
+    }
+
+    if (status == STATUS_SUCCESS && length - 14 > maximumPayload)
+      status = STATUS_PAYLOAD_TOO_LARGE;
+
+    if (status == STATUS_SUCCESS) {
+      struct MeshReceive receive;
+      receive.source = source;
+      receive.destination = destination;
+      receive.options = (options & TX_OPTION_DISABLE_ACK) ? 0x00 : 0x01;
+      receive.data = &frame[14];
+      receive.length = length - 14;
+
+      status = meshUnicast(hops, !(options & TX_OPTION_DISABLE_ACK), now,
+                           &statusTime, &attempts,
+                           meshDeliverReceive, &receive);
+    } else {
+      statusTime = now;
+    }
+  }
+
+  source->busyUntil = statusTime;
+
+  meshLog("%s: transmit %u bytes, %d attempts, status 0x%02x",
+          source->name, (unsigned int)(length - 14), attempts,
+          (unsigned int)status);
+
+  if (frameId == 0)
+    /* No Transmit Status requested */
+    return;
+
+  unsigned char response[7];
+  response[0] = 0x8b;
+  response[1] = frameId;
+  if (destination != NULL) {
+    response[2] = destination->address16[0];
+    response[3] = destination->address16[1];
+  } else {
+    response[2] = 0xff;
+    response[3] = 0xfe;
+  }
+  response[4] = attempts - 1; /* Transmit retry count */
+  response[5] = status;
+  response[6] = discovery;
+
+  meshQueueFrame(source, statusTime, response, sizeof(response));
+}
+
+struct MeshRemoteAT {
+  struct MeshNode *destination;
+  const unsigned char *command;
+  const unsigned char *param;
+  size_t paramLength;
+  struct MeshAT const *value;
+  int applied;
+};
+
+static void meshDeliverRemoteAT(uint64_t time, void *context)
+{
+  struct MeshRemoteAT *remote = context;
+
+  /* Retransmissions don't repeat the command */
+  if (remote->applied++)
+    return;
+
+  meshApplyAT(remote->destination, time, remote->command,
+              remote->param, remote->paramLength, &remote->value);
+}
+
+/*
+ * Remote AT Command Request (0x17).
+ */
+static void meshRemoteAT(struct MeshNode *source, uint64_t now,
+                         const unsigned char *frame, size_t length)
+{
+  if (length < 15)
+    return;
+
+  struct MeshNode *destination = meshFind(&frame[2]);
+
+  struct MeshRemoteAT remote;
+  remote.destination = destination;
+  remote.command = &frame[13];
+  remote.param = &frame[15];
+  remote.paramLength = length - 15;
+  remote.value = NULL;
+  remote.applied = 0;
+
+  if (now < source->busyUntil)
+    now = source->busyUntil;
+
+  unsigned char status = AT_STATUS_TRANSMISSION_FAILURE;
+  uint64_t statusTime = now + meshMs(meshAckTimeoutMs);
+
+  if (destination != NULL && destination != source) {
+    int attempts;
+    if (meshUnicast(meshPathHops(source, destination), 1, now,
+                    &statusTime, &attempts,
+                    meshDeliverRemoteAT, &remote) == STATUS_SUCCESS)
+      status = AT_STATUS_OK;
+  }
+
+  source->busyUntil = statusTime;
+
+  meshLog("%s: remote AT%c%c, status %u", source->name,
+          frame[13], frame[14], (unsigned int)status);
+
+  if (frame[1] == 0)
+    return;
+
+  unsigned char response[32];
+  size_t responseLength = 0;
+  response[responseLength++] = 0x97;
+  response[responseLength++] = frame[1];
+  memcpy(&response[responseLength], &frame[2], 8);
+  responseLength += 8;
+  if (destination != NULL)
+    memcpy(&response[responseLength], destination->address16, 2);
+  else
+    memcpy(&response[responseLength], &frame[10], 2);
+  responseLength += 2;
+  response[responseLength++] = frame[13];
+  response[responseLength++] = frame[14];
+  response[responseLength++] = status;
+  if (status == AT_STATUS_OK && remote.value != NULL) {
+    memcpy(&response[responseLength], remote.value->value,
+           remote.value->length);
+    responseLength += remote.value->length;
+  }
+
+  meshQueueFrame(source, statusTime, response, responseLength);
+}
+
+/*
+ * Create Source Route (0x21).
+ */
+static void meshCreateSourceRoute(struct MeshNode *source,
+                                  const unsigned char *frame, size_t length)
+{
+  if (length < 14 || source != meshCoordinator())
+    return;
+
+  struct MeshNode *destination = meshFind(&frame[2]);
+  if (destination == NULL)
+    return;
+
+  destination->sourceRouteHops = frame[13];
+  meshLog("%s: source route with %d hops", destination->name,
+          destination->sourceRouteHops);
+}
+
+static void meshFrame(struct MeshNode *node, const unsigned char *frame,
+                      size_t length)
+{
+  const uint64_t now = meshNow();
+
+  meshFrames++;
+
+  switch (frame[0]) {
+  case 0x08:
+    meshLocalAT(node, now, frame, length);
+    break;
+  case 0x10:
+    meshTransmit(node, now, frame, length);
+    break;
+  case 0x17:
+    meshRemoteAT(node, now, frame, length);
+    break;
+  case 0x21:
+    meshCreateSourceRoute(node, frame, length);
+    break;
+  default:
+    meshLog("%s: ignoring frame type 0x%02x", node->name,
+            (unsigned int)frame[0]);
+    break;
+  }
+}
+
+/*
+ * Parse API mode 2 frames arriving from a node.
+ */
+static void meshReceive(struct MeshNode *node, const unsigned char *data,
+                        size_t length)
+{
+  size_t index;
+  for (index = 0; index < length; index++) {
+    unsigned char ch = data[index];
+
+    if (ch == 0x7e) {
+      node->index = 0;
+      node->length = 0;
+      node->escaped = 0;
+      continue;
+    }
+
+    if (ch == 0x7d) {
+      node->escaped = 1;
+      continue;
+    }
+
+    if (node->escaped) {
+      ch ^= 0x20;
+      node->escaped = 0;
+    }
+
+    if (node->index >= sizeof(node->frame) + 3)
+      /* Too long, wait for the next frame */
+      continue;
+
+    if (node->index < 2) {
+      node->length = (node->length << 8) | ch;
+      node->index++;
+      continue;
+    }
+
+    const size_t offset = node->index++ - 2;
+    if (offset < node->length && offset < sizeof(node->frame)) {
+      node->frame[offset] = ch;
+      continue;
+    }
+
+    if (offset == node->length && node->length <= sizeof(node->frame)) {
+      unsigned char checksum = ch;
+      size_t frameIndex;
+      for (frameIndex = 0; frameIndex < node->length; frameIndex++)
+        checksum += node->frame[frameIndex];
+
+      if (checksum == 0xff && node->length > 0)
+        meshFrame(node, node->frame, node->length);
+      else
+        meshLog("%s: bad checksum", node->name);
+    }
+  }
+}
+
+static char const *meshOpenPty(int *fdp)
+{
+  const int fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if (fd < 0 || grantpt(fd) < 0 || unlockpt(fd) < 0) {
+    perror("xbeemesh: pty");
+    exit(1);
+  }
+
+  char const *name = strdup(ptsname(fd));
+
+  /*
+   * Hold the terminal side open ourselves, so that its user can come
+   * and go without the pty hanging up.  It must be raw, or the
+   * terminal would echo our output straight back to us.
+   */
+  const int slave = open(name, O_RDWR | O_NOCTTY);
+  struct termios tio;
+  if (slave < 0 || tcgetattr(slave, &tio) < 0) {
+    perror(name);
+    exit(1);
+  }
+  cfmakeraw(&tio);
+  tcsetattr(slave, TCSANOW, &tio);
+
+  *fdp = fd;
+  return name;
+}
+
+static int meshParseAddress(char const *text, unsigned char *address64)
+{
+  int index;
+  for (index = 0; index < 8; index++) {
+    unsigned int byte;
+    if (sscanf(&text[index * 2], "%2x", &byte) != 1)
+      return -1;
+    address64[index] = byte;
+  }
+  return 0;
+}
+
+static void meshAddNode(const unsigned char *address64, int hops,
+                        int resetPin)
+{
+  if (meshNodeCount == MESH_MAX_NODES) {
+    fprintf(stderr, "xbeemesh: too many nodes\n");
+    exit(2);
+  }
+
+  const int number = meshNodeCount++;
+  struct MeshNode *node = &meshNodes[number];
+  memset(node, 0, sizeof(*node));
+
+  memcpy(node->address64, address64, 8);
+  if (number == 0) {
+    /* The coordinator is always 0x0000 */
+    node->address16[0] = 0;
+    node->address16[1] = 0;
+  } else {
+    node->address16[0] = 0x10 + number;
+    node->address16[1] = number;
+  }
+
+  node->hops = hops;
+  int hop;
+  for (hop = 0; hop < hops; hop++) {
+    /* Nearest the target first, as in the Route Record Indicator */
+    node->route[hop * 2] = 0x80 + number;
+    node->route[hop * 2 + 1] = hops - hop;
+  }
+
+  node->resetPin = resetPin;
+  node->sourceRouteHops = -1;
+}
+
+static void meshStopped(int signum)
+{
+  (void)signum;
+  meshStop = 1;
+}
+
+static void meshUsage(char const *name)
+{
+  fprintf(stderr,
+          "Usage: %s [options] -t <address>[:hops[:resetpin]] ...\n"
+          "  -t  Add a target XBee, with a 64-bit address in hex, the number\n"
+          "      of intermediate hops from the coordinator (default 0) and\n"
+          "      the DIO pin driving the AVR reset (default 3)\n"
+          "  -C  Coordinator 64-bit address (default 0013a20000000000)\n"
+          "  -s  Random seed\n"
+          "  -l  Per hop latency in ms (default %g)\n"
+          "  -j  Per hop jitter in ms (default %g)\n"
+          "  -L  Per hop loss probability (default %g)\n"
+          "  -D  Duplicate delivery probability (default %g)\n"
+          "  -n  Maximum RF payload in bytes (default %u)\n"
+          "  -R  Unicast retries (default %d)\n"
+          "  -A  Acknowledgement time-out in ms (default %g)\n"
+          "  -d  Route discovery time in ms (default %g)\n"
+          "  -a  Route Record Indicator before every packet from a target,\n"
+          "      rather than only the first\n"
+          "  -v  Log mesh activity\n",
+          name, meshLatencyMs, meshJitterMs, meshLoss, meshDuplicate,
+          meshMaxPayload, meshRetries, meshAckTimeoutMs, meshDiscoveryMs);
+  exit(2);
+}
+
+int main(int argc, char **argv)
+{
+  unsigned char coordinator[8] =
+    { 0x00, 0x13, 0xa2, 0x00, 0x00, 0x00, 0x00, 0x00 };
+  char *targets[MESH_MAX_NODES];
+  int targetCount = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "t:C:s:l:j:L:D:n:R:A:d:av")) != -1) {
+    switch (opt) {
+    case 't':
+      if (targetCount == MESH_MAX_NODES - 1)
+        meshUsage(argv[0]);
+      targets[targetCount++] = optarg;
+      break;
+    case 'C':
+      if (meshParseAddress(optarg, coordinator) < 0)
+        meshUsage(argv[0]);
+      break;
+    case 's':
+      meshRandomState = strtoull(optarg, NULL, 0) * 0x9e3779b97f4a7c15ULL;
+      if (meshRandomState == 0)
+        meshRandomState = 1;
+      break;
+    case 'l':
+      meshLatencyMs = atof(optarg);
+      break;
+    case 'j':
+      meshJitterMs = atof(optarg);
+      break;
+    case 'L':
+      meshLoss = atof(optarg);
+      break;
+    case 'D':
+      meshDuplicate = atof(optarg);
+      break;
+    case 'n':
+      meshMaxPayload = atoi(optarg);
+      break;
+    case 'R':
+      meshRetries = atoi(optarg);
+      break;
+    case 'A':
+      meshAckTimeoutMs = atof(optarg);
+      break;
+    case 'd':
+      meshDiscoveryMs = atof(optarg);
+      break;
+    case 'a':
+      meshRouteRecordEvery = 1;
+      break;
+    case 'v':
+      meshVerbose = 1;
+      break;
+    default:
+      meshUsage(argv[0]);
+    }
+  }
+
+  if (optind != argc || targetCount == 0)
+    meshUsage(argv[0]);
+
+  meshAddNode(coordinator, 0, 0);
+
+  int target;
+  for (target = 0; target < targetCount; target++) {
+    unsigned char address64[8];
+    int hops = 0;
+    int resetPin = 3;
+    char const *spec = targets[target];
+    char const *colon = strchr(spec, ':');
+
+    if (strlen(spec) < 16 || meshParseAddress(spec, address64) < 0 ||
+        (colon != NULL && sscanf(colon, ":%d:%d", &hops, &resetPin) < 1) ||
+        hops < 0 || hops > MESH_MAX_HOPS || resetPin < 0 || resetPin > 7)
+      meshUsage(argv[0]);
+
+    meshAddNode(address64, hops, resetPin);
+  }
+
+  int index;
+  for (index = 0; index < meshNodeCount; index++) {
+    struct MeshNode *node = &meshNodes[index];
+    char const *pty = meshOpenPty(&node->fd);
+    char *name = malloc(32);
+    snprintf(name, 32, "%02x%02x%02x%02x%02x%02x%02x%02x",
+             node->address64[0], node->address64[1], node->address64[2],
+             node->address64[3], node->address64[4], node->address64[5],
+             node->address64[6], node->address64[7]);
+    node->name = name;
+    printf("%s %s on %s\n", index == 0 ? "coordinator" : "target",
+           name, pty);
+  }
+  fflush(stdout);
+
+  signal(SIGINT, meshStopped);
+  signal(SIGTERM, meshStopped);
+
+  struct pollfd pfds[MESH_MAX_NODES];
+  for (index = 0; index < meshNodeCount; index++) {
+    pfds[index].fd = meshNodes[index].fd;
+    pfds[index].events = POLLIN;
+  }
+
+  while (!meshStop) {
+    uint64_t now = meshNow();
+
+    while (meshEventCount > 0 && meshEvents[0]->time <= now) {
+      struct MeshEvent *event = meshEventPop();
+      meshDeliver(event);
+      free(event);
+    }
+
+    int timeout = -1;
+    if (meshEventCount > 0)
+      /* Round up, so as not to spin */
+      timeout = (meshEvents[0]->time - now + 999999) / 1000000;
+
+    if (poll(pfds, meshNodeCount, timeout) < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("xbeemesh: poll");
+      return 1;
+    }
+
+    for (index = 0; index < meshNodeCount; index++) {
+      if (!(pfds[index].revents & POLLIN))
+        continue;
+
+      unsigned char data[1024];
+      const ssize_t rc = read(pfds[index].fd, data, sizeof(data));
+      if (rc > 0)
+        meshReceive(&meshNodes[index], data, rc);
+    }
+  }
+
+  fprintf(stderr, "xbeemesh: %lu frames, %lu delivered, %lu lost, "
+          "%lu duplicated, %lu failed\n",
+          meshFrames, meshDelivered, meshLost, meshDuplicated, meshFailed);
+
+  return 0;
+}
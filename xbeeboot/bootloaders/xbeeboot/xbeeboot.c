@@ -128,6 +128,22 @@
 /* UART number (0..n) for devices with more than          */
 /* one hardware uart (644P, 1284P, etc)                   */
 /*                                                        */
+/* XBEEBOOT_HOST:                                         */
+/* Build as a host process against a simulated AVR, for   */
+/* exercising the protocol without hardware.  See         */
+/* host/xbeeboot_host.c and "make host".                  */
+/*                                                        */
+/* RESUME_JOURNAL:                                        */
+/* Journal progress through flash in the top three bytes  */
+/* of EEPROM, which can no longer be programmed.  After   */
+/* any reset, stay in the bootloader until an interrupted */
+/* update completes.                                      */
+/*                                                        */
+/* APP_ENTRY:                                             */
+/* Accept a request handed over by the application (see   */
+/* the XBeeBootEntry library) across a watchdog reset,    */
+/* without the programmer resetting the AVR via the XBee. */
+/*                                                        */
 /**********************************************************/
 
 /**********************************************************/
@@ -241,6 +257,14 @@ optiboot_version = 256*(OPTIBOOT_MAJVER + OPTIBOOT_CUSTOMVER) + OPTIBOOT_MINVER;
 
 
 #include <inttypes.h>
+
+#ifdef XBEEBOOT_HOST
+/*
+ * Simulated AVR, standing in for the avr-libc headers, "boot.h" and
+ * "pin_defs.h".
+ */
+#include "host/xbeeboot_host.h"
+#else
 #include <avr/io.h>
 #include <avr/pgmspace.h>
 #include <avr/eeprom.h>
@@ -261,6 +285,7 @@ optiboot_version = 256*(OPTIBOOT_MAJVER + OPTIBOOT_CUSTOMVER) + OPTIBOOT_MINVER;
  * ability to use UART=n and LED=D3, and some avr family bit name differences.
  */
 #include "pin_defs.h"
+#endif
 
 /*
  * stk500.h contains the constant definitions for the stk500v1 comm protocol
@@ -334,8 +359,10 @@ optiboot_version = 256*(OPTIBOOT_MAJVER + OPTIBOOT_CUSTOMVER) + OPTIBOOT_MINVER;
 /*
  * We can never load flash with more than 1 page at a time, so we can save
  * some code space on parts with smaller pagesize by using a smaller int.
+ * MULTI_PAGE transfers several pages at a time, so always needs the
+ * larger one.
  */
-#if SPM_PAGESIZE > 255
+#if SPM_PAGESIZE > 255 || defined(MULTI_PAGE)
 typedef uint16_t pagelen_t ;
 #define GETLENGTH(len) len = getch()<<8; len |= getch()
 #else
@@ -351,14 +378,22 @@ typedef uint8_t pagelen_t;
  * supress some compile-time options we want.)
  */
 
+#ifndef XBEEBOOT_HOST
 int main(void) __attribute__ ((OS_main)) __attribute__ ((section (".init9")));
+#else
+int main(void);
+#endif
 
 void __attribute__((noinline)) putch(char);
 uint8_t __attribute__((noinline)) getch(void);
 void __attribute__((noinline)) verifySpace();
 void __attribute__((noinline)) watchdogConfig(uint8_t x);
+#ifdef APP_ENTRY
+static void sendAck(const uint8_t sequence);
+#endif
 
 static inline void getNch(uint8_t);
+static void pushBuffer(const uint8_t max);
 #if LED_START_FLASHES > 0
 static inline void flash_led(uint8_t);
 #endif
@@ -367,11 +402,19 @@ static inline void writebuffer(int8_t memtype, uint8_t *mybuff,
 			       uint16_t address, pagelen_t len);
 static inline void read_mem(uint8_t memtype,
 			    uint16_t address, pagelen_t len);
+#if defined(SUPPORT_EEPROM) || defined(BIGBOOT)
+static void eepromService(void);
+static void eepromFlush(void);
+#endif
 
 #ifdef SOFT_UART
 void uartDelay() __attribute__ ((naked));
 #endif
+#ifndef XBEEBOOT_HOST
 void appStart(uint8_t rstFlags) __attribute__ ((naked));
+#else
+void appStart(uint8_t rstFlags);
+#endif
 
 /*
  * RAMSTART should be self-explanatory.  It's bigger on parts with a
@@ -428,10 +471,169 @@ void appStart(uint8_t rstFlags) __attribute__ ((naked));
  */
 #define XBEEBOOT_MAX_CHUNK 54
 
+/*
+ * XBeeBoot extension parameters for STK_GET_PARAMETER, outside the
+ * range used by the STK500 itself.
+ *
+ * Unknown parameters get the generic 0x03 reply, so the feature
+ * bitmap always has the top bit set to tell the two apart.  Builds
+ * without any extensions don't answer it at all.
+ */
+#define XBEEBOOT_PARAM_FEATURES 0xe0
+#define XBEEBOOT_PARAM_JOURNAL 0xe1 /* 0xe1 state, 0xe2-0xe3 page */
+#define XBEEBOOT_PARAM_PAGES 0xe4
+#define XBEEBOOT_PARAM_COUNTERS 0xe5 /* 0xe5-0xe8, see bootCounters */
+
+#define XBEEBOOT_FEATURE_BASE 0x80
+#define XBEEBOOT_FEATURE_JOURNAL 0x01
+#define XBEEBOOT_FEATURE_BUSY 0x02
+#define XBEEBOOT_FEATURE_RETRANSMIT 0x04
+#define XBEEBOOT_FEATURE_MULTI_PAGE 0x08
+#define XBEEBOOT_FEATURE_LINK_TEST 0x10
+#define XBEEBOOT_FEATURE_COUNTERS 0x20
+
+#ifdef RESUME_JOURNAL
+#define XBEEBOOT_FEATURES_JOURNAL XBEEBOOT_FEATURE_JOURNAL
+#else
+#define XBEEBOOT_FEATURES_JOURNAL 0
+#endif
+
+#ifdef BUSY_REPLY
+#define XBEEBOOT_FEATURES_BUSY XBEEBOOT_FEATURE_BUSY
+#else
+#define XBEEBOOT_FEATURES_BUSY 0
+#endif
+
+#ifdef RETRANSMIT_TIMER
+#define XBEEBOOT_FEATURES_RETRANSMIT XBEEBOOT_FEATURE_RETRANSMIT
+#else
+#define XBEEBOOT_FEATURES_RETRANSMIT 0
+#endif
+
+#ifdef MULTI_PAGE
+#define XBEEBOOT_FEATURES_MULTI_PAGE XBEEBOOT_FEATURE_MULTI_PAGE
+#else
+#define XBEEBOOT_FEATURES_MULTI_PAGE 0
+#endif
+
+#ifdef LINK_TEST
+#define XBEEBOOT_FEATURES_LINK_TEST XBEEBOOT_FEATURE_LINK_TEST
+#else
+#define XBEEBOOT_FEATURES_LINK_TEST 0
+#endif
+
+#ifdef COUNTERS
+#define XBEEBOOT_FEATURES_COUNTERS XBEEBOOT_FEATURE_COUNTERS
+#else
+#define XBEEBOOT_FEATURES_COUNTERS 0
+#endif
+
+#define XBEEBOOT_FEATURES (XBEEBOOT_FEATURE_BASE | XBEEBOOT_FEATURES_JOURNAL | \
+			   XBEEBOOT_FEATURES_BUSY | XBEEBOOT_FEATURES_RETRANSMIT | \
+			   XBEEBOOT_FEATURES_MULTI_PAGE | XBEEBOOT_FEATURES_LINK_TEST | \
+			   XBEEBOOT_FEATURES_COUNTERS)
+
+/*
+ * XBeeBoot's own commands, clear of the STK500 command codes.
+ *
+ * LINK_TEST: [count high] [count low] [count bytes of data]
+ *            [reply count high] [reply count low] [CRC_EOP]
+ * The data is thrown away, and the reply carries that many bytes,
+ * counting down to 1 (modulo 256).  Flash is never touched, so the
+ * programmer can time the link alone.
+ */
+#define XBEEBOOT_CMD_LINK_TEST 0xf0
+
+#ifdef MULTI_PAGE
+/*
+ * STK_PROG_PAGE may carry this many flash pages, which is as many as
+ * buff has room for below the VIRTUAL_BOOT_PARTITION vectors and our
+ * variables.  STK_READ_PAGE may read any length.
+ */
+#define XBEEBOOT_MAX_PAGES 2
+#endif
+
+#ifdef RETRANSMIT_TIMER
+/*
+ * Resend a FIRMWARE_REPLY that hasn't been ACK'd in time, timed with
+ * Timer1.  The time allowed follows twice the round trip measured on
+ * replies ACK'd first time, doubling on every resend, but is never
+ * less than this many milliseconds.  RETRANSMIT_TIMER=1 takes the
+ * default, anything larger is the minimum itself.
+ */
+#if RETRANSMIT_TIMER > 1
+#define RETRANSMIT_MS RETRANSMIT_TIMER
+#else
+#define RETRANSMIT_MS 50
+#endif
+
+#define RETRANSMIT_TICKS (F_CPU / 1024 * RETRANSMIT_MS / 1000)
+#if RETRANSMIT_TICKS > 0x7fff
+#error RETRANSMIT_TIMER period is too long for Timer1
+#endif
+
+#ifdef SOFT_UART
+#error RETRANSMIT_TIMER needs the hardware UART
+#endif
+#endif
+
+#ifdef RESUME_JOURNAL
+/*
+ * The journal is a state byte followed by the word address of a flash
+ * page written, as given to STK_LOAD_ADDRESS.  The state is
+ * JOURNAL_INCOMPLETE from the first page written until
+ * STK_LEAVE_PROGMODE.
+ *
+ * To spare the EEPROM, the page is only recorded for the first page of
+ * an update and then every RESUME_JOURNAL_INTERVAL pages (a power of
+ * two), so it may trail the last page written.  That only costs
+ * rewriting a few pages when resuming.
+ */
+#ifndef RESUME_JOURNAL_EEPROM
+#define RESUME_JOURNAL_EEPROM (E2END - 2)
+#endif
+#ifndef RESUME_JOURNAL_INTERVAL
+#define RESUME_JOURNAL_INTERVAL 16
+#endif
+#define journalState ((uint8_t *)(RESUME_JOURNAL_EEPROM))
+#define journalPage ((uint16_t *)(RESUME_JOURNAL_EEPROM + 1))
+#define JOURNAL_INCOMPLETE 0xa5
+#endif
+
 #define lastIncomingSequence (*(uint8_t*)(RAMSTART+SPM_PAGESIZE*3+0))
 #define lastOutgoingSequence (*(uint8_t*)(RAMSTART+SPM_PAGESIZE*3+1))
 #define frameMode (*(uint8_t*)(RAMSTART+SPM_PAGESIZE*3+2))
 #define outputIndex (*(uint8_t*)(RAMSTART+SPM_PAGESIZE*3+3))
+/* 4-5 are appEntryMagic, with APP_ENTRY */
+#define retransmitTicks (*(uint16_t*)(RAMSTART+SPM_PAGESIZE*3+6))
+
+#if defined(SUPPORT_EEPROM) || defined(BIGBOOT)
+/*
+ * EEPROM data from the last STK_PROG_PAGE, buff[eepromIndex] up to
+ * buff[eepromLength], still to be written from eepromAddress.  See
+ * eepromService().
+ */
+#define eepromIndex (*(uint16_t*)(RAMSTART+SPM_PAGESIZE*3+8))
+#define eepromLength (*(uint16_t*)(RAMSTART+SPM_PAGESIZE*3+10))
+#define eepromAddress (*(uint16_t*)(RAMSTART+SPM_PAGESIZE*3+12))
+#endif
+
+#ifdef COUNTERS
+/*
+ * Protocol events since the bootloader started, each wrapping at 256:
+ * frames with a bad checksum, data out of sequence, data dropped
+ * because the last packet wasn't used up yet, and replies resent.
+ */
+#define bootCounters ((uint8_t*)(RAMSTART+SPM_PAGESIZE*3+14))
+#define COUNTER_CHECKSUM 0
+#define COUNTER_SEQUENCE 1
+#define COUNTER_BUSY 2
+#define COUNTER_RETRANSMIT 3
+#define COUNTERS_LENGTH 4
+#define COUNT(counter) (bootCounters[counter]++)
+#else
+#define COUNT(counter)
+#endif
 
 #define packetBuffer ((uint8_t*)(RAMSTART+SPM_PAGESIZE*4))
 #define packet ((uint8_t*)(RAMSTART+SPM_PAGESIZE*5))
@@ -440,6 +642,21 @@ void appStart(uint8_t rstFlags) __attribute__ ((naked));
 #define outputPayload (&outputBuffer[14])
 #define outputText (&outputBuffer[17])
 
+#ifdef APP_ENTRY
+/*
+ * An application using the XBeeBootEntry library hands the
+ * programmer's first request over to us.  It stores the request in
+ * packetBuffer/frameMode, its sequence in lastIncomingSequence and the
+ * programmer's address in lastAddress, exactly as poll() would have,
+ * sets appEntryMagic and then lets the watchdog reset the AVR.  RAM
+ * survives the watchdog reset.
+ *
+ * The layout of all of these is shared with XBeeBootEntry.h.
+ */
+#define appEntryMagic (*(uint16_t*)(RAMSTART+SPM_PAGESIZE*3+4))
+#define APP_ENTRY_MAGIC 0xb007
+#endif
+
 /* Virtual boot partition support */
 #ifdef VIRTUAL_BOOT_PARTITION
 #define rstVect0_sav (*(uint8_t*)(RAMSTART+SPM_PAGESIZE*2+4))
@@ -510,7 +727,9 @@ int main(void) {
   //
   // If not, uncomment the following instructions:
   // cli();
+#ifndef XBEEBOOT_HOST
   asm volatile ("clr __zero_reg__");
+#endif
 #if defined(__AVR_ATmega8__) || defined (__AVR_ATmega32__)
   SP=RAMEND;  // This is done by hardware reset
 #endif
@@ -523,10 +742,26 @@ int main(void) {
    */
   ch = MCUSR;
   MCUSR = 0;
+#ifdef APP_ENTRY
+  const uint8_t appEntry =
+    (ch & _BV(WDRF)) && appEntryMagic == APP_ENTRY_MAGIC;
+  if (appEntry)
+    /* Honour the hand over only once */
+    appEntryMagic = 0;
+  else
+#endif
   if (ch & (_BV(WDRF) | _BV(BORF) | _BV(PORF)))
+#ifdef RESUME_JOURNAL
+    /*
+     * An interrupted update leaves a partial application in flash.
+     * Rather than run it, wait here for the update to be resumed.
+     * The watchdog will keep bringing us back until it is.
+     */
+    if (eeprom_read_byte(journalState) != JOURNAL_INCOMPLETE)
+#endif
       appStart(ch);
 
-#if LED_START_FLASHES > 0
+#if (LED_START_FLASHES > 0) || defined(RETRANSMIT_TIMER)
   // Set up Timer 1 for timeout counter
   TCCR1B = _BV(CS12) | _BV(CS10); // div 1024
 #endif
@@ -563,10 +798,34 @@ int main(void) {
   flash_led(LED_START_FLASHES * 2);
 #endif
 
-  frameMode = FRAME_UNKNOWN;
   lastOutgoingSequence = 0;
-  lastIncomingSequence = 0;
   outputIndex = 0;
+#ifdef RETRANSMIT_TIMER
+  retransmitTicks = RETRANSMIT_TICKS;
+#endif
+#if defined(SUPPORT_EEPROM) || defined(BIGBOOT)
+  eepromIndex = eepromLength = 0;
+#endif
+#ifdef COUNTERS
+  {
+    uint8_t index;
+    for (index = 0; index < COUNTERS_LENGTH; index++)
+      bootCounters[index] = 0;
+  }
+#endif
+#ifdef APP_ENTRY
+  if (appEntry)
+    /*
+     * The application received the request but didn't acknowledge
+     * it.  Do so now, and carry on as if poll() had received it.
+     */
+    sendAck(lastIncomingSequence);
+  else
+#endif
+  {
+    frameMode = FRAME_UNKNOWN;
+    lastIncomingSequence = 0;
+  }
 
   /* Forever loop: exits by causing WDT reset */
   for (;;) {
@@ -584,6 +843,23 @@ int main(void) {
 	  putch(optiboot_version & 0xFF);
       } else if (which == 0x81) {
 	  putch(optiboot_version >> 8);
+#if XBEEBOOT_FEATURES != XBEEBOOT_FEATURE_BASE
+      } else if (which == XBEEBOOT_PARAM_FEATURES) {
+	  putch(XBEEBOOT_FEATURES);
+#endif
+#ifdef RESUME_JOURNAL
+      } else if ((uint8_t)(which - XBEEBOOT_PARAM_JOURNAL) < 3) {
+	  putch(eeprom_read_byte(journalState +
+				 (uint8_t)(which - XBEEBOOT_PARAM_JOURNAL)));
+#endif
+#ifdef MULTI_PAGE
+      } else if (which == XBEEBOOT_PARAM_PAGES) {
+	  putch(XBEEBOOT_MAX_PAGES);
+#endif
+#ifdef COUNTERS
+      } else if ((uint8_t)(which - XBEEBOOT_PARAM_COUNTERS) < COUNTERS_LENGTH) {
+	  putch(bootCounters[(uint8_t)(which - XBEEBOOT_PARAM_COUNTERS)]);
+#endif
       } else {
 	/*
 	 * GET PARAMETER returns a generic 0x03 reply for
@@ -629,6 +905,22 @@ int main(void) {
       savelength = length;
       desttype = getch();
 
+#ifdef MULTI_PAGE
+      if ((pagelen_t)(length - 1) >= XBEEBOOT_MAX_PAGES * SPM_PAGESIZE) {
+	// More than buff holds: take the data, but write none of it
+	while (length--)
+	  getch();
+	verifySpace();
+	putch(STK_FAILED);
+	continue;
+      }
+#endif
+
+#if defined(SUPPORT_EEPROM) || defined(BIGBOOT)
+      // The last EEPROM page may still be being written from buff
+      eepromFlush();
+#endif
+
       // read a page worth of contents
       bufPtr = buff;
       do *bufPtr++ = getch();
@@ -637,6 +929,14 @@ int main(void) {
       // Read command terminator, start reply
       verifySpace();
 
+#ifdef RESUME_JOURNAL
+      // The journal's EEPROM bytes are not the programmer's to write
+      if (desttype == 'E' && address + savelength > RESUME_JOURNAL_EEPROM) {
+	putch(STK_FAILED);
+	continue;
+      }
+#endif
+
 #ifdef VIRTUAL_BOOT_PARTITION
 #if FLASHEND > 8192
 /*
@@ -692,10 +992,69 @@ int main(void) {
 #endif // FLASHEND
 #endif // VBP
 
+#ifdef MULTI_PAGE
+      /*
+       * Write flash a page at a time, moving address on to each page
+       * in turn.  EEPROM is written all together.
+       */
+      bufPtr = buff;
+      for (;;) {
+	length = desttype != 'E' && savelength > SPM_PAGESIZE ?
+	  SPM_PAGESIZE : savelength;
+	writebuffer(desttype, bufPtr, address, length);
+#else
       writebuffer(desttype, buff, address, savelength);
+#endif
 
+#ifdef RESUME_JOURNAL
+      /*
+       * Record the page only once it has been written, and before
+       * marking the update incomplete, so that the page is never left
+       * over from an earlier update.
+       */
+      if (desttype != 'E' &&
+	  (eeprom_read_byte(journalState) != JOURNAL_INCOMPLETE ||
+	   ((address / SPM_PAGESIZE + 1) &
+	    (RESUME_JOURNAL_INTERVAL - 1)) == 0)) {
+	uint16_t page = address >> 1;
+#ifdef RAMPZ
+	if (RAMPZ)
+	  page |= 0x8000;
+#endif
+	eeprom_update_word(journalPage, page);
+	eeprom_update_byte(journalState, JOURNAL_INCOMPLETE);
+      }
+#endif
 
+#ifdef MULTI_PAGE
+	savelength -= length;
+	if (savelength == 0)
+	  break;
+	bufPtr += length;
+	address += length;
+#ifdef RAMPZ
+	// Carry into RAMPZ, as the programmer's word address would
+	if (address == 0)
+	  RAMPZ++;
+#endif
+      }
+#endif
     }
+#ifdef LINK_TEST
+    else if(ch == XBEEBOOT_CMD_LINK_TEST) {
+      uint16_t count;
+      count = getch() << 8;
+      count |= getch();
+      while (count--)
+	getch();
+
+      count = getch() << 8;
+      count |= getch();
+      verifySpace();
+      while (count)
+	putch(count--);
+    }
+#endif
     /* Read memory block mode, length is big endian.  */
     else if(ch == STK_READ_PAGE) {
       uint8_t desttype;
@@ -716,19 +1075,27 @@ int main(void) {
       putch(SIGNATURE_1);
       putch(SIGNATURE_2);
     }
-#if 0
-    /*
-     * Setting the watchdog fast on STK_LEAVE_PROGMODE gives just
-     * enough time to deliver the response to STK_LEAVE_PROGMODE over
-     * a standard local serial link, but nowhere near enough time to
-     * respond over wireless, which causes avrdude to hang on exit.
-     */
     else if (ch == STK_LEAVE_PROGMODE) { /* 'Q' */
-      // Adaboot no-wait mod
-      watchdogConfig(WATCHDOG_16MS);
+#if defined(SUPPORT_EEPROM) || defined(BIGBOOT)
+      eepromFlush();
+#endif
       verifySpace();
-    }
+#ifdef RESUME_JOURNAL
+      // The update is complete, the application may run again
+      eeprom_update_byte(journalState, 0xff);
 #endif
+      putch(STK_OK);
+      /*
+       * Adaboot no-wait mod.  Setting the watchdog fast straight away
+       * gives nowhere near enough time to respond over wireless, so
+       * wait until the reply has been ACK'd before starting the
+       * application.
+       */
+      pushBuffer(0);
+      watchdogConfig(WATCHDOG_16MS);
+      for (;;)
+	;
+    }
     else {
       // This covers the response to commands like STK_ENTER_PROGMODE
       verifySpace();
@@ -738,8 +1105,19 @@ int main(void) {
 }
 
 void uartPutch(char ch) {
-#ifndef SOFT_UART
-  while (!(UART_SRA & _BV(UDRE0)));
+#if defined(XBEEBOOT_HOST)
+#if defined(SUPPORT_EEPROM) || defined(BIGBOOT)
+  while (eepromIndex != eepromLength && !hostUartSendReady())
+    eepromService();
+#endif
+  hostUartPutch(ch);
+#elif !defined(SOFT_UART)
+  while (!(UART_SRA & _BV(UDRE0)))
+#if defined(SUPPORT_EEPROM) || defined(BIGBOOT)
+    eepromService();
+#else
+    ;
+#endif
   UART_UDR = ch;
 #else
   __asm__ __volatile__ (
@@ -778,7 +1156,13 @@ uint8_t uartGetch(void) {
 #endif
 #endif
 
-#ifdef SOFT_UART
+#if defined(XBEEBOOT_HOST)
+#if defined(SUPPORT_EEPROM) || defined(BIGBOOT)
+  while (eepromIndex != eepromLength && !hostUartReady())
+    eepromService();
+#endif
+  ch = hostUartGetch();
+#elif defined(SOFT_UART)
     watchdogReset();
   __asm__ __volatile__ (
     "1: sbic  %[uartPin],%[uartBit]\n"  // Wait for start edge
@@ -805,7 +1189,11 @@ uint8_t uartGetch(void) {
 );
 #else
   while(!(UART_SRA & _BV(RXC0)))
+#if defined(SUPPORT_EEPROM) || defined(BIGBOOT)
+    eepromService();
+#else
     ;
+#endif
   if (!(UART_SRA & _BV(FE0))) {
       /*
        * A Framing Error indicates (probably) that something is talking
@@ -901,10 +1289,44 @@ void sendAck(const uint8_t sequence) {
   transmit(TXHEADER_BYTES + 2);
 }
 
+#ifdef BUSY_REPLY
+/*
+ * [BUSY = 2] [SEQUENCE]: the request with this sequence number
+ * arrived intact but couldn't be taken yet, so try again shortly.
+ */
+static __attribute__((__noinline__))
+void sendBusy(const uint8_t sequence) {
+  outputPayload[0] = 2 /* BUSY */;
+  outputPayload[1] = sequence;
+  transmit(TXHEADER_BYTES + 2);
+}
+#endif
+
 static __attribute__((__noinline__))
 uint8_t poll(uint8_t waitForAck) {
   register uint8_t sawInvalid = 0;
   for (;;) {
+#ifdef RETRANSMIT_TIMER
+    /*
+     * Between frames, give up waiting for an ACK once the timer set
+     * by pushBuffer() runs out: our reply or its ACK was lost.
+     */
+    if (waitForAck)
+      for (;;) {
+        if (TIFR1 & _BV(TOV1))
+          return 1;
+#if defined(XBEEBOOT_HOST)
+        if (hostUartReady())
+#else
+        if (UART_SRA & _BV(RXC0))
+#endif
+          break;
+#if defined(SUPPORT_EEPROM) || defined(BIGBOOT)
+        eepromService();
+#endif
+      }
+#endif
+
     /* Start delimiter */
     if (uartGetch() != 0x7e)
       continue;
@@ -933,9 +1355,11 @@ uint8_t poll(uint8_t waitForAck) {
       checksum -= dataByte;
     }
 
-    if (checksum != escGetch())
+    if (checksum != escGetch()) {
       /* Checksum mismatch */
+      COUNT(COUNTER_CHECKSUM);
       continue;
+    }
 
     if (packet[0] != 0x90)
       /* ZigBee Receive packet */
@@ -989,12 +1413,13 @@ uint8_t poll(uint8_t waitForAck) {
 
       if (sequence != nextSequence) {
         /* Wrong sequence */
+        COUNT(COUNTER_SEQUENCE);
         if (sawInvalid++)
           sendAck(lastSequence);
         continue;
       }
 
-      if (frameMode != FRAME_FRAME)
+      if (frameMode != FRAME_FRAME) {
         /*
          * This means the buffer already has data in it, which means
          * we cannot receive more data yet.  We can't ACK the data, we
@@ -1005,7 +1430,16 @@ uint8_t poll(uint8_t waitForAck) {
          *
          * This will generally never happen.
          */
+        COUNT(COUNTER_BUSY);
+#ifdef BUSY_REPLY
+        /*
+         * Say so, rather than leave the programmer to wait out its
+         * full retransmit timeout.
+         */
+        sendBusy(sequence);
+#endif
         continue;
+      }
 
       {
         uint8_t index;
@@ -1042,12 +1476,45 @@ void pushBuffer(const uint8_t max) {
   while ((++sequence & 0xff) == 0);
   lastOutgoingSequence = sequence;
 
-  do {
+#ifdef RETRANSMIT_TIMER
+  uint8_t resent = 0;
+#endif
+  for (;;) {
     outputPayload[0] = 1 /* REQUEST */;
     outputPayload[1] = sequence;
     outputPayload[2] = 24 /* FIRMWARE_REPLY */;
     transmit(TXHEADER_BYTES + 3 + outputIndex);
-  } while (poll(sequence));
+#ifdef RETRANSMIT_TIMER
+    TCNT1 = -retransmitTicks;
+    TIFR1 = _BV(TOV1);
+#endif
+    if (!poll(sequence))
+      break;
+    COUNT(COUNTER_RETRANSMIT);
+#ifdef RETRANSMIT_TIMER
+    /* Perhaps the ACK is just slow, so allow longer next time */
+    if (retransmitTicks < 0x8000)
+      retransmitTicks <<= 1;
+    resent = 1;
+#endif
+  }
+
+#ifdef RETRANSMIT_TIMER
+  if (!resent) {
+    /*
+     * Only a reply ACK'd first time gives an unambiguous round trip.
+     * Settle on twice that, saturating rather than wrapping to a
+     * tiny timeout on a slow link.
+     */
+    const uint16_t roundTrip = TCNT1 + retransmitTicks;
+    const uint16_t half = retransmitTicks >> 1;
+    retransmitTicks = half + roundTrip;
+    if (retransmitTicks < half)
+      retransmitTicks = 0xffff;
+    else if (retransmitTicks < RETRANSMIT_TICKS)
+      retransmitTicks = RETRANSMIT_TICKS;
+  }
+#endif
 
   outputIndex = 0;
 }
@@ -1155,16 +1622,30 @@ void flash_led(uint8_t count) {
 
 // Watchdog functions. These are only safe with interrupts turned off.
 void watchdogReset() {
+#ifdef XBEEBOOT_HOST
+  hostWatchdogReset();
+#else
   __asm__ __volatile__ (
     "wdr\n"
   );
+#endif
 }
 
 void watchdogConfig(uint8_t x) {
+#ifdef XBEEBOOT_HOST
+  hostWatchdogConfig(x);
+#else
   WDTCSR = _BV(WDCE) | _BV(WDE);
   WDTCSR = x;
+#endif
 }
 
+#ifdef XBEEBOOT_HOST
+void appStart(uint8_t rstFlags) {
+  watchdogConfig(WATCHDOG_OFF);
+  hostAppStart(rstFlags);
+}
+#else
 void appStart(uint8_t rstFlags) {
   // save the reset flags in the designated register
   //  This can be saved in a main program by putting code in .init0 (which
@@ -1181,6 +1662,7 @@ void appStart(uint8_t rstFlags) {
     "ijmp\n"::[rstvec] "M"(appstart_vec)
   );
 }
+#endif
 
 /*
  * void writebuffer(memtype, buffer, address, length)
@@ -1191,9 +1673,17 @@ static inline void writebuffer(int8_t memtype, uint8_t *mybuff,
     switch (memtype) {
     case 'E': // EEPROM
 #if defined(SUPPORT_EEPROM) || defined(BIGBOOT)
-        while(len--) {
-	    eeprom_write_byte((uint8_t *)(address++), *mybuff++);
-        }
+	/*
+	 * Each byte takes over 3ms to write, so rather than hold up
+	 * the reply, write them while waiting on the UART for the next
+	 * command.  mybuff is always buff, which is left alone until
+	 * the next STK_PROG_PAGE flushes what remains.  So STK_OK here
+	 * only means the data was taken: it is in EEPROM once the
+	 * STK_LEAVE_PROGMODE that follows has been acknowledged.
+	 */
+	eepromAddress = address;
+	eepromIndex = 0;
+	eepromLength = len;
 #else
 	/*
 	 * On systems where EEPROM write is not supported, just busy-loop
@@ -1215,12 +1705,45 @@ static inline void writebuffer(int8_t memtype, uint8_t *mybuff,
 	    uint8_t *bufPtr = mybuff;
 	    uint16_t addrPtr = (uint16_t)(void*)address;
 
+#ifdef SKIP_UNCHANGED
+	    /*
+	     * Leave the page alone if it already holds this data, saving
+	     * the erase and write time and a wear cycle.  elpm without
+	     * the post-increment, so that RAMPZ is left as it is for
+	     * the SPM below.
+	     */
+	    {
+		pagelen_t remaining = len;
+		do {
+		    uint8_t ch;
+#if defined(RAMPZ) && !defined(XBEEBOOT_HOST)
+		    __asm__ ("elpm %0,Z\n" : "=r" (ch) : "z" (addrPtr));
+#else
+		    ch = pgm_read_byte_near(addrPtr);
+#endif
+		    if (ch != *bufPtr++)
+			break;
+		    addrPtr++;
+		} while (--remaining);
+
+		if (remaining == 0)
+		    break;
+
+		bufPtr = mybuff;
+		addrPtr = (uint16_t)(void*)address;
+	    }
+#endif
+
 	    /*
 	     * Start the page erase and wait for it to finish.  There
 	     * used to be code to do this while receiving the data over
 	     * the serial link, but the performance improvement was slight,
 	     * and we needed the space back.
 	     */
+#if defined(SUPPORT_EEPROM) || defined(BIGBOOT) || defined(RESUME_JOURNAL)
+	    // SPM is ignored while an EEPROM write is in progress
+	    eeprom_busy_wait();
+#endif
 	    __boot_page_erase_short((uint16_t)(void*)address);
 	    boot_spm_busy_wait();
 
@@ -1249,6 +1772,34 @@ static inline void writebuffer(int8_t memtype, uint8_t *mybuff,
     } // switch
 }
 
+#if defined(SUPPORT_EEPROM) || defined(BIGBOOT)
+/*
+ * Write the next byte of pending EEPROM data, once the EEPROM has
+ * finished with the last one.  Bytes that already hold their value
+ * aren't written at all.  Called while waiting on the UART.
+ *
+ * With SOFT_UART nothing waits on the UART in C, so the data is only
+ * written by eepromFlush().
+ */
+static void eepromService(void)
+{
+    if (eepromIndex != eepromLength && eeprom_is_ready())
+	eeprom_update_byte((uint8_t *)(eepromAddress++), buff[eepromIndex++]);
+}
+
+/*
+ * Finish writing pending EEPROM data, before buff is reused, the
+ * EEPROM is read back, or we leave.  Returns once the last byte is
+ * in EEPROM, not just started.
+ */
+static void eepromFlush(void)
+{
+    while (eepromIndex != eepromLength)
+	eepromService();
+    eeprom_busy_wait();
+}
+#endif
+
 static inline void read_mem(uint8_t memtype, uint16_t address, pagelen_t length)
 {
     uint8_t ch;
@@ -1257,6 +1808,7 @@ static inline void read_mem(uint8_t memtype, uint16_t address, pagelen_t length)
 
 #if defined(SUPPORT_EEPROM) || defined(BIGBOOT)
     case 'E': // EEPROM
+	eepromFlush();
 	do {
 	    putch(eeprom_read_byte((uint8_t *)(address++)));
 	} while (--length);
@@ -1272,6 +1824,9 @@ static inline void read_mem(uint8_t memtype, uint16_t address, pagelen_t length)
 	    else if (address == saveVect1) ch = saveVect1_sav;
 	    else ch = pgm_read_byte_near(address);
 	    address++;
+#elif defined(XBEEBOOT_HOST)
+	    ch = pgm_read_byte_near(address);
+	    address++;
 #elif defined(RAMPZ)
 	    // Since RAMPZ should already be set, we need to use EPLM directly.
 	    // Also, we can use the autoincrement version of lpm to update "address"
@@ -0,0 +1,140 @@
+/*
+ * XBeeBootEntry
+ *
+ * Copyright (C) 2015-2020 David Sainty
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "XBeeBootEntry.h"
+
+#include <avr/interrupt.h>
+#include <avr/wdt.h>
+
+#define FRAME_IDLE 0xff
+
+#define PACKOFF_ADDRESS 1
+#define PACKOFF_PAYLOAD 12
+
+#define STK_GET_SYNC 0x30
+
+XBeeBootEntryClass XBeeBootEntry;
+
+XBeeBootEntryClass::XBeeBootEntryClass()
+  : position(FRAME_IDLE), length(0), checksum(0), escaped(false)
+{
+}
+
+void XBeeBootEntryClass::process(uint8_t ch)
+{
+  if (ch == 0x7e) {
+    /* Frame start, always */
+    position = 0;
+    escaped = false;
+    return;
+  }
+
+  if (position == FRAME_IDLE)
+    return;
+
+  if (ch == 0x7d) {
+    escaped = true;
+    return;
+  }
+
+  if (escaped) {
+    ch ^= 0x20;
+    escaped = false;
+  }
+
+  if (position == 0) {
+    /* Length MSB, far too long for us if non-zero */
+    position = ch == 0 ? 1 : FRAME_IDLE;
+    return;
+  }
+
+  if (position == 1) {
+    /* Length LSB */
+    length = ch;
+    checksum = 0xff;
+    position = length <= sizeof(frame) ? 2 : FRAME_IDLE;
+    return;
+  }
+
+  const uint8_t index = position - 2;
+  if (index < length) {
+    frame[index] = ch;
+    checksum -= ch;
+    position++;
+    return;
+  }
+
+  position = FRAME_IDLE;
+  if (ch == checksum)
+    handleFrame(frame, length);
+}
+
+void XBeeBootEntryClass::poll(Stream &xbee)
+{
+  while (xbee.available() > 0)
+    process(xbee.read());
+}
+
+void XBeeBootEntryClass::handleFrame(const uint8_t *frame, uint8_t length)
+{
+  /* ZigBee Receive Packet, carrying at least one byte of data */
+  if (length < PACKOFF_PAYLOAD + 4 || frame[0] != 0x90)
+    return;
+
+  const uint8_t *payload = &frame[PACKOFF_PAYLOAD];
+  const uint8_t dataLength = length - PACKOFF_PAYLOAD - 3;
+
+  /*
+   * avrdude's first request is always STK_GET_SYNC.  Anything else is
+   * not the start of an update, or is left over from an earlier one.
+   */
+  if (payload[0] != 1 /* REQUEST */ || payload[1] == 0 ||
+      payload[2] != 23 /* FIRMWARE_DELIVER */ ||
+      payload[3] != STK_GET_SYNC)
+    return;
+
+  /*
+   * The frame may itself lie in the bootloader's regions (it does
+   * whenever the sketch has more than a few hundred bytes of globals),
+   * so take what we need onto the stack before writing any of them.
+   */
+  uint8_t address[10];
+  uint8_t data[XBEEBOOT_ENTRY_FRAME_MAX];
+  const uint8_t sequence = payload[1];
+
+  uint8_t index;
+  for (index = 0; index < 10; index++)
+    address[index] = frame[PACKOFF_ADDRESS + index];
+  for (index = 0; index < dataLength; index++)
+    data[index] = payload[3 + index];
+
+  /*
+   * From here on we are overwriting memory the sketch may be using,
+   * so nothing else may run.
+   */
+  cli();
+
+  for (index = 0; index < 10; index++)
+    XBEEBOOT_LAST_ADDRESS[index] = address[index];
+
+  /* The bootloader consumes its buffer from the end */
+  for (index = 0; index < dataLength; index++)
+    XBEEBOOT_PACKET_BUFFER[dataLength - 1 - index] = data[index];
+  XBEEBOOT_FRAME_MODE = dataLength;
+
+  XBEEBOOT_LAST_INCOMING_SEQUENCE = sequence;
+  XBEEBOOT_APP_ENTRY_MAGIC = XBEEBOOT_APP_ENTRY;
+
+  /* The bootloader acknowledges the request after the reset */
+  wdt_enable(WDTO_15MS);
+  for (;;)
+    ;
+}
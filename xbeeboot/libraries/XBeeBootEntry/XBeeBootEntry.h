@@ -0,0 +1,84 @@
+/*
+ * XBeeBootEntry
+ *
+ * Lets a running sketch hand an Over-The-Air firmware update straight
+ * over to the XBeeBoot bootloader, so that avrdude doesn't need to
+ * reset the AVR via the remote XBee's reset pin (-x xbeeappentry).
+ *
+ * The bootloader must be built with APP_ENTRY, and the XBee must be in
+ * API mode 2 (AP=2) as usual for XBeeBoot.
+ *
+ * Copyright (C) 2015-2020 David Sainty
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef XBeeBootEntry_h
+#define XBeeBootEntry_h
+
+#include <Arduino.h>
+
+/*
+ * The bootloader's receive state, which we fill in before the
+ * watchdog reset.  These must match xbeeboot.c.
+ */
+#if !defined(RAMSTART)
+#error XBeeBootEntry needs RAMSTART from <avr/io.h> for this chip
+#endif
+
+#define XBEEBOOT_LAST_INCOMING_SEQUENCE \
+  (*(uint8_t*)(RAMSTART+SPM_PAGESIZE*3+0))
+#define XBEEBOOT_FRAME_MODE (*(uint8_t*)(RAMSTART+SPM_PAGESIZE*3+2))
+#define XBEEBOOT_APP_ENTRY_MAGIC (*(uint16_t*)(RAMSTART+SPM_PAGESIZE*3+4))
+#define XBEEBOOT_PACKET_BUFFER ((uint8_t*)(RAMSTART+SPM_PAGESIZE*4))
+#define XBEEBOOT_LAST_ADDRESS ((uint8_t*)(RAMSTART+SPM_PAGESIZE*6+2))
+
+#define XBEEBOOT_APP_ENTRY 0xb007
+
+/*
+ * Enough of a ZigBee Receive Packet (0x90) frame to hold the
+ * programmer's STK_GET_SYNC request:
+ *
+ * [0x90] [64-bit address] [16-bit address] [options]
+ * [REQUEST = 1] [SEQUENCE] [FIRMWARE_DELIVER = 23] [DATA...]
+ */
+#define XBEEBOOT_ENTRY_FRAME_MAX 32
+
+class XBeeBootEntryClass {
+public:
+  XBeeBootEntryClass();
+
+  /*
+   * Feed one byte received from the XBee (API mode 2).  Enters the
+   * bootloader, and so doesn't return, if this completes a request
+   * from avrdude.
+   */
+  void process(uint8_t ch);
+
+  /*
+   * Read and process everything available from the XBee.
+   */
+  void poll(Stream &xbee);
+
+  /*
+   * For sketches that already parse API frames themselves.  Offer an
+   * unescaped frame, from the API identifier up to but excluding the
+   * checksum.  Enters the bootloader if it is a request from avrdude,
+   * otherwise returns.
+   */
+  static void handleFrame(const uint8_t *frame, uint8_t length);
+
+private:
+  uint8_t position;
+  uint8_t length;
+  uint8_t checksum;
+  bool escaped;
+  uint8_t frame[XBEEBOOT_ENTRY_FRAME_MAX];
+};
+
+extern XBeeBootEntryClass XBeeBootEntry;
+
+#endif
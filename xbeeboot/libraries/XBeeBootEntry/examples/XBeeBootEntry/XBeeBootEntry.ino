@@ -0,0 +1,21 @@
+/*
+ * XBeeBootEntry
+ *
+ * Blinks the LED, and hands over to the XBeeBoot bootloader when
+ * avrdude starts an Over-The-Air update with "-x xbeeappentry".
+ *
+ * The XBee is expected on the hardware serial port at 9600 baud, in
+ * API mode 2, and the bootloader must be built with APP_ENTRY.
+ */
+#include <XBeeBootEntry.h>
+
+void setup() {
+  Serial.begin(9600);
+  pinMode(LED_BUILTIN, OUTPUT);
+}
+
+void loop() {
+  XBeeBootEntry.poll(Serial);
+
+  digitalWrite(LED_BUILTIN, (millis() / 500) & 1);
+}